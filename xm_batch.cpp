@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "xm_file.h"
+
+// Batch re-save of many modules: each worker owns one XMFile and reuses its buffers
+// between files, so memory stays at roughly one module per worker.
+
+// out is the path under -o: a directory argument is mirrored below its own name
+typedef struct {
+    std::string path;
+    std::string out;
+    std::string clash; // earlier input with the same output path, this one isn't written
+} batch_file_t;
+
+static std::vector<batch_file_t> files;
+static std::atomic<size_t> next_file(0);
+static std::mutex report_lock;
+static const char *out_dir = NULL;
+static bool quiet = false;
+
+// Directories already walked, a symlink back up the tree (dir/self -> .) is entered once
+static std::set<std::pair<dev_t, ino_t>> walked_dirs;
+
+static uint64_t total_in = 0, total_out = 0;
+static size_t num_ok = 0, num_fail = 0;
+
+static bool is_xm_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 3 && strcasecmp(name + len - 3, ".xm") == 0;
+}
+
+static void add_file(const std::string &path, const std::string &out) {
+    batch_file_t f;
+    f.path = path;
+    f.out = out;
+    files.push_back(f);
+}
+
+static std::string base_name(const std::string &path) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) {
+        return path;
+    }
+    size_t slash = path.rfind('/', end);
+    size_t start = slash == std::string::npos ? 0 : slash + 1;
+    return path.substr(start, end + 1 - start);
+}
+
+static void add_path(const std::string &path, std::string out = "") {
+    if (out.empty()) {
+        out = base_name(path);
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "Skip %s: not found\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        add_file(path, out);
+        return;
+    }
+    if (!walked_dirs.insert(std::make_pair(st.st_dev, st.st_ino)).second) {
+        fprintf(stderr, "Skip %s: directory already walked\n", path.c_str());
+        return;
+    }
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        fprintf(stderr, "Skip %s: can't open directory\n", path.c_str());
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        std::string sub = path + "/" + ent->d_name;
+        if (stat(sub.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            add_path(sub, out + "/" + ent->d_name);
+        } else if (is_xm_name(ent->d_name)) {
+            add_file(sub, out + "/" + ent->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+static void add_list(const char *list_file) {
+    FILE *f = strcmp(list_file, "-") ? fopen(list_file, "r") : stdin;
+    if (f == NULL) {
+        fprintf(stderr, "Skip list %s: can't open\n", list_file);
+        return;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0]) {
+            add_path(line);
+        }
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+}
+
+// Inputs that would land on the same output file: the first one listed wins
+static void find_clashes() {
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) { return files[a].out < files[b].out; });
+    size_t first = 0;
+    for (size_t i = 1; i < order.size(); i++) {
+        if (files[order[i]].out != files[order[first]].out) {
+            first = i;
+        } else {
+            files[order[i]].clash = files[order[first]].path;
+        }
+    }
+}
+
+// The output tree is made before the workers start, a directory that can't be made stops the run
+static bool make_parent_dirs(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        struct stat st;
+        if (mkdir(dir.c_str(), 0755) != 0 && !(errno == EEXIST && stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+            fprintf(stderr, "Can't create directory %s: %s\n", dir.c_str(), errno == EEXIST ? "not a directory" : strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void worker() {
+    XMFile xmfile;
+    xmfile.set_log(XM_LOG_NONE);
+    xmfile.set_load_flags(XM_LOAD_KEEP_BUFFERS);
+    std::vector<uint8_t> out_buf;
+
+    for (size_t i = next_file++; i < files.size(); i = next_file++) {
+        const char *path = files[i].path.c_str();
+        if (out_dir && !files[i].clash.empty()) {
+            std::lock_guard<std::mutex> lock(report_lock);
+            num_fail++;
+            printf("FAIL %s (same output file as %s)\n", path, files[i].clash.c_str());
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        struct stat st;
+        uint64_t in_size = stat(path, &st) == 0 ? st.st_size : 0;
+
+        int ret = xmfile.open_xm(path);
+        if (ret == 0) {
+            ret = xmfile.read_all();
+        }
+        uint64_t out_size = 0;
+        if (ret == 0) {
+            if (out_dir) {
+                std::string out_path = std::string(out_dir) + "/" + files[i].out;
+                ret = xmfile.save_as(out_path.c_str());
+                out_size = (ret == 0 && stat(out_path.c_str(), &st) == 0) ? st.st_size : 0;
+            } else {
+                ret = xmfile.save_to_memory(out_buf); // dry run
+                out_size = out_buf.size();
+            }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(report_lock);
+        if (ret == 0) {
+            num_ok++;
+            total_in += in_size;
+            total_out += out_size;
+            if (!quiet) {
+                printf("OK   %s %llu -> %llu bytes, %.2f ms\n", path, (unsigned long long)in_size, (unsigned long long)out_size, ms);
+            }
+        } else {
+            num_fail++;
+            printf("FAIL %s (error %d)\n", path, ret);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned int jobs = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            add_list(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quiet = true;
+        } else {
+            add_path(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        printf("Usage: %s [-j threads] [-o out_dir] [-q] [-l list_file|-] <file or dir>...\n", argv[0]);
+        printf("Without -o the modules are re-saved to memory only (dry run).\n");
+        printf("With -o a directory argument is mirrored as out_dir/<its name>/<relative path>.\n");
+        return -1;
+    }
+    if (jobs == 0) {
+        jobs = 1;
+    }
+    if (jobs > files.size()) {
+        jobs = files.size();
+    }
+    if (out_dir) {
+        find_clashes();
+        for (size_t i = 0; i < files.size(); i++) {
+            if (files[i].clash.empty() && !make_parent_dirs(std::string(out_dir) + "/" + files[i].out)) {
+                return -1;
+            }
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < jobs; t++) {
+        threads.emplace_back(worker);
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%zu ok, %zu failed, %u threads, %.3f s\n", num_ok, num_fail, jobs, sec);
+    printf("%.1f files/s, %.1f MB/s in, %.1f MB/s out\n", (num_ok + num_fail) / sec, total_in / 1e6 / sec, total_out / 1e6 / sec);
+    return num_fail ? 1 : 0;
+}
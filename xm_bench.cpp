@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include "xm_file.h"
+#include "xm_player.h"
+#include "xm_timeline.h"
+#include "xm_cache.h"
+
+// Benchmarks for the codecs and the full load/save path.
+// Usage: xm_bench [--json out.json] [--time seconds] [dir or .xm file]...
+
+static std::atomic<uint64_t> alloc_count(0);
+
+#ifdef __GLIBC__
+// malloc itself is interposed, so the sample arena and xm_pcm_t buffers are counted along
+// with operator new (which allocates through malloc)
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+extern "C" void *malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+    alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) {
+    alloc_count++;
+    return __libc_realloc(p, size);
+}
+
+static const char *alloc_label = "allocs/op";
+#else
+void *operator new(size_t size) {
+    alloc_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static const char *alloc_label = "news/op"; // malloc isn't hooked here, operator new only
+#endif
+
+typedef struct {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double mb_per_s;
+    double allocs_per_op;
+    size_t bytes_per_op;
+    double voices_per_s; // player cases only: voice-samples mixed per second
+} bench_result_t;
+
+static std::vector<bench_result_t> results;
+static double min_time = 0.2; // seconds per case
+
+static void keep(const void *p) {
+    __asm__ __volatile__("" : : "g"(p) : "memory");
+}
+
+// Runs fn until min_time has passed; bytes_per_op is the data size MB/s is based on
+template <typename F>
+static void bench(const std::string &name, size_t bytes_per_op, F fn) {
+    typedef std::chrono::steady_clock clock;
+    fn(); // warm up
+    uint64_t iters = 1;
+    double sec = 0;
+    uint64_t allocs = 0;
+    for (;;) {
+        uint64_t a0 = alloc_count;
+        clock::time_point t0 = clock::now();
+        for (uint64_t i = 0; i < iters; i++) {
+            fn();
+        }
+        sec = std::chrono::duration<double>(clock::now() - t0).count();
+        allocs = alloc_count - a0;
+        if (sec >= min_time) {
+            break;
+        }
+        iters = sec > 0 ? (uint64_t)(iters * (min_time * 1.2 / sec)) + 1 : iters * 10;
+    }
+
+    bench_result_t r;
+    r.name = name;
+    r.iterations = iters;
+    r.ns_per_op = sec * 1e9 / iters;
+    r.mb_per_s = bytes_per_op / 1e6 / (sec / iters);
+    r.allocs_per_op = (double)allocs / iters;
+    r.bytes_per_op = bytes_per_op;
+    r.voices_per_s = 0;
+    results.push_back(r);
+    printf("%-48s %14.1f ns/op %10.1f MB/s %10.2f %s\n", name.c_str(), r.ns_per_op, r.mb_per_s, r.allocs_per_op, alloc_label);
+    fflush(stdout);
+}
+
+static void bench_patterns() {
+    const int rows = 64, channels = 16;
+    std::vector<xm_unit_t> cells(rows * channels);
+    srand(1);
+    for (size_t i = 0; i < cells.size(); i++) {
+        if (rand() % 3 == 0) {
+            cells[i].note = rand() % 96 + 1;
+            cells[i].inst = rand() % 16 + 1;
+            if (rand() % 2) cells[i].vol = 0x10 + rand() % 64;
+            if (rand() % 4 == 0) {
+                cells[i].fx_cmd = rand() % 16;
+                cells[i].fx_val = rand() % 256;
+            }
+        }
+    }
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+    size_t cell_bytes = cells.size() * sizeof(xm_unit_t);
+
+    std::vector<xm_unit_t> out;
+    bench("pattern/unpack 64x16", cell_bytes, [&]() {
+        unpack_xm_pattern(packed.data(), packed.size(), out, rows, channels);
+        keep(out.data());
+    });
+    // As in a loaded file, where the rest of the file follows the pattern data
+    std::vector<uint8_t> in_file(packed);
+    in_file.resize(cells.size() * 6);
+    bench("pattern/unpack_in_file 64x16", cell_bytes, [&]() {
+        unpack_xm_pattern(in_file.data(), packed.size(), out, rows, channels, in_file.size());
+        keep(out.data());
+    });
+    std::vector<uint8_t> repacked;
+    bench("pattern/pack 64x16", cell_bytes, [&]() {
+        repacked.clear();
+        pack_xm_pattern(cells, repacked, rows, channels);
+        keep(repacked.data());
+    });
+}
+
+static void bench_dpcm(const char *kernels) {
+    const size_t n = 1 << 20;
+    std::vector<int16_t> pcm16(n), dpcm16(n), out16(n);
+    std::vector<int8_t> pcm8(n), dpcm8(n), out8(n);
+    srand(2);
+    int acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc = (acc * 7 + (rand() % 2001 - 1000) * 8) / 8; // smooth-ish waveform
+        pcm16[i] = (int16_t)acc;
+        pcm8[i] = (int8_t)(acc >> 8);
+    }
+    encode_dpcm_16bit(pcm16.data(), dpcm16.data(), n);
+    encode_dpcm_8bit(pcm8.data(), dpcm8.data(), n);
+
+    std::string p = std::string("dpcm/") + kernels + "/";
+    bench(p + "encode_8bit 1M", n, [&]() { keep((void *)encode_dpcm_8bit(pcm8.data(), out8.data(), n)); });
+    bench(p + "encode_16bit 1M", n * 2, [&]() { keep((void *)encode_dpcm_16bit(pcm16.data(), out16.data(), n)); });
+    bench(p + "decode_8bit 1M", n, [&]() { decode_dpcm_8bit(dpcm8.data(), out8.data(), n); keep(out8.data()); });
+    bench(p + "decode_8bit_to_16bit 1M", n, [&]() { decode_dpcm_8bit_to_16bit(dpcm8.data(), out16.data(), n); keep(out16.data()); });
+    bench(p + "decode_16bit 1M", n * 2, [&]() { decode_dpcm_16bit(dpcm16.data(), out16.data(), n); keep(out16.data()); });
+}
+
+static void bench_env() {
+    env_point_t env[12];
+    for (int i = 0; i < 12; i++) {
+        env[i].x = i * 50;
+        env[i].y = (i * 37) % 65;
+    }
+    std::vector<int16_t> table;
+    genEnvTable(env, 12, table);
+    bench("envelope/genEnvTable 12pt", table.size() * 2, [&]() { genEnvTable(env, 12, table); keep(table.data()); });
+    env_type_t type = {1, 0, 0};
+    env_cursor_t cur;
+    bench("envelope/cursor 12pt full walk", table.size() * 2, [&]() {
+        env_cursor_init(&cur, env, 12, type, 0, 0, 0);
+        int32_t sum = 0;
+        for (uint16_t x = env[0].x; x <= env[11].x; x++) {
+            sum += env_cursor_value(&cur);
+            env_cursor_step(&cur, true);
+        }
+        keep(&sum);
+    });
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> &buf) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf.resize(size > 0 ? size : 0);
+    size_t got = fread(buf.data(), 1, buf.size(), f);
+    fclose(f);
+    return got == buf.size();
+}
+
+static void bench_module(const std::string &path) {
+    std::vector<uint8_t> file;
+    if (!read_file(path, file)) {
+        fprintf(stderr, "Skip %s: can't read\n", path.c_str());
+        return;
+    }
+    const char *base = strrchr(path.c_str(), '/');
+    std::string name = base ? base + 1 : path;
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    if (xm.load_from_memory(file.data(), file.size())) {
+        fprintf(stderr, "Skip %s: not a valid module\n", path.c_str());
+        return;
+    }
+    bench("module/read_all " + name, file.size(), [&]() {
+        xm.load_from_memory(file.data(), file.size());
+    });
+    bench("module/read_all_fresh " + name, file.size(), [&]() {
+        XMFile fresh; // first-load cost, nothing to reuse
+        fresh.set_log(XM_LOG_NONE);
+        fresh.load_from_memory(file.data(), file.size());
+    });
+    bench("module/open_xm+read_all " + name, file.size(), [&]() {
+        xm.open_xm(path.c_str());
+        xm.read_all();
+    });
+    // Cold-start path: decoded state from a save_cache() file, PCM used from the mapping
+    const char *tmp_dir = getenv("TMPDIR");
+    std::string cache_path = std::string(tmp_dir && tmp_dir[0] ? tmp_dir : "/tmp") + "/xm_bench_XXXXXX";
+    int cache_fd = mkstemp(&cache_path[0]);
+    if (cache_fd >= 0) {
+        close(cache_fd);
+        if (xm.save_cache(cache_path.c_str()) == 0) {
+            XMFile cached;
+            cached.set_log(XM_LOG_NONE);
+            bench("module/open_cache " + name, file.size(), [&]() {
+                cached.open_cache(cache_path.c_str());
+                keep(cached.get_header());
+            });
+        }
+        remove(cache_path.c_str());
+    }
+    XMFile probe;
+    probe.set_log(XM_LOG_NONE);
+    bench("module/probe_xm " + name, file.size(), [&]() {
+        probe.probe_xm(path.c_str());
+        keep(probe.get_header());
+    });
+    bench("module/clone " + name, file.size(), [&]() {
+        XMFile copy = xm.clone(); // headers only, cells and PCM are shared
+        keep(copy.get_header());
+    });
+    std::vector<uint8_t> out;
+    xm.save_to_memory(out);
+    bench("module/save_to_memory " + name, out.size(), [&]() {
+        xm.save_to_memory(out);
+        keep(out.data());
+    });
+    // Autosave after a one-note edit: everything else is copied from the kept source
+    XMFile edited;
+    edited.set_log(XM_LOG_NONE);
+    edited.set_load_flags(XM_LOAD_KEEP_SOURCE);
+    if (edited.load_from_memory(file.data(), file.size()) == 0 && edited.get_pattern(0)) {
+        bench("module/save_incremental " + name, out.size(), [&]() {
+            edited.save_to_memory(out);
+            keep(out.data());
+        });
+    }
+
+    XMCache cache(256 << 20);
+    cache.get(path.c_str());
+    bench("cache/get hit " + name, file.size(), [&]() {
+        keep(cache.get(path.c_str()).get());
+    });
+
+    XMTimeline timeline;
+    bench("timeline/build " + name, file.size(), [&]() {
+        timeline.build(&xm, 44100);
+        keep(&timeline);
+    });
+
+    // One second of 44.1 kHz stereo per op; MB/s is output PCM. "padded" plays the
+    // XM_LOAD_PAD_LOOPS buffers, the mixer's fast loop then runs up to the loop end.
+    const size_t frames = 44100;
+    std::vector<int16_t> pcm(frames * 2);
+    for (int padded = 0; padded < 2; padded++) {
+        xm.set_load_flags(padded ? XM_LOAD_PAD_LOOPS : 0);
+        xm.load_from_memory(file.data(), file.size());
+        XMPlayer player(&xm, 44100);
+        uint64_t ops = 0;
+        bench(std::string(padded ? "player/render_padded 1s " : "player/render 1s ") + name, pcm.size() * sizeof(int16_t), [&]() {
+            player.render(pcm.data(), frames);
+            keep(pcm.data());
+            ops++;
+        });
+        bench_result_t &r = results.back();
+        r.voices_per_s = (double)player.get_voice_frames() / ops / (r.ns_per_op * 1e-9);
+        printf("%-48s %14.1f Mvoices/s\n", "", r.voices_per_s / 1e6);
+        if (!padded && timeline.size()) {
+            size_t i = 0;
+            bench("player/seek " + name, 0, [&]() {
+                player.seek(timeline.at(i));
+                i = (i + 7919) % timeline.size();
+            });
+        }
+    }
+}
+
+static void add_modules(const char *path, std::vector<std::string> &modules) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        modules.push_back(path);
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > 3 && strcasecmp(ent->d_name + len - 3, ".xm") == 0) {
+            modules.push_back(std::string(path) + "/" + ent->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+static void json_string(FILE *f, const std::string &s) {
+    fputc('"', f);
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            fputc('\\', f);
+        }
+        fputc(s[i], f);
+    }
+    fputc('"', f);
+}
+
+static int write_json(const char *path, const char *kernels) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"timestamp\": %lld,\n  \"dpcm_kernels\": ", (long long)time(NULL));
+    json_string(f, kernels);
+    fprintf(f, ",\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_t &r = results[i];
+        fprintf(f, "    {\"name\": ");
+        json_string(f, r.name);
+        fprintf(f, ", \"iterations\": %llu, \"ns_per_op\": %.3f, \"mb_per_s\": %.3f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %zu, \"voices_per_s\": %.0f}%s\n",
+                (unsigned long long)r.iterations, r.ns_per_op, r.mb_per_s, r.allocs_per_op, r.bytes_per_op, r.voices_per_s,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *json_path = NULL;
+    std::vector<std::string> modules;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else {
+            add_modules(argv[i], modules);
+        }
+    }
+
+    const char *kernels = dpcm_simd_name();
+    printf("DPCM kernels: %s\n", kernels);
+    bench_patterns();
+    dpcm_set_simd(false);
+    bench_dpcm("scalar");
+    dpcm_set_simd(true);
+    if (strcmp(kernels, "scalar") != 0) {
+        bench_dpcm(kernels);
+    }
+    bench_env();
+    for (size_t i = 0; i < modules.size(); i++) {
+        bench_module(modules[i]);
+    }
+
+    if (json_path) {
+        return write_json(json_path, kernels);
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include "xm_cache.h"
+
+#include <sys/stat.h>
+
+static bool file_stamp(const char *path, int64_t *size, int64_t *mtime_ns) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    *size = st.st_size;
+#if defined(__APPLE__)
+    *mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    *mtime_ns = (int64_t)st.st_mtime * 1000000000;
+#endif
+    return true;
+}
+
+static size_t module_bytes(XMFile *xm) {
+    const xm_stats_t &s = xm->get_stats();
+    return sizeof(XMFile) + s.pattern_bytes + s.sample_bytes + s.envelope_bytes + s.buffer_bytes;
+}
+
+XMCache::XMCache(size_t budget_bytes, uint32_t load_flags)
+    : budget(budget_bytes), load_flags((load_flags & ~XM_LOAD_LAZY_PATTERNS) & ~XM_LOAD_KEEP_BUFFERS) {
+}
+
+void XMCache::drop(std::unordered_map<std::string, xm_cache_entry_t>::iterator it) {
+    stats.bytes -= it->second.bytes;
+    lru.erase(it->second.lru);
+    entries.erase(it);
+}
+
+// The newest entry is kept even when it alone is over the budget
+void XMCache::evict() {
+    while (stats.bytes > budget && lru.size() > 1) {
+        drop(entries.find(lru.back()));
+        stats.evictions++;
+    }
+    stats.entries = lru.size();
+}
+
+std::shared_ptr<const XMFile> XMCache::get(const char *path, int *err) {
+    int64_t size, mtime_ns;
+    if (!file_stamp(path, &size, &mtime_ns)) {
+        if (err) *err = FILE_OPEN_ERROR;
+        return NULL;
+    }
+    std::string key(path);
+    std::unique_lock<std::mutex> guard(lock);
+    bool waited = false;
+    for (;;) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            break;
+        }
+        xm_cache_entry_t &e = it->second;
+        if (e.loading) {
+            if (!waited) {
+                stats.merged++;
+                waited = true;
+            }
+            loaded.wait(guard);
+            continue;
+        }
+        if (e.size != size || e.mtime_ns != mtime_ns) {
+            drop(it);
+            stats.stale++;
+            stats.entries = lru.size();
+            break;
+        }
+        if (!waited) {
+            stats.hits++;
+        }
+        lru.splice(lru.begin(), lru, e.lru);
+        if (err) *err = 0;
+        return e.xm;
+    }
+
+    // Parse outside the lock, other gets of this path wait on the loading entry
+    stats.misses++;
+    xm_cache_entry_t &slot = entries[key];
+    slot.loading = true;
+    slot.size = size;
+    slot.mtime_ns = mtime_ns;
+    guard.unlock();
+
+    std::shared_ptr<XMFile> xm;
+    int ret;
+    size_t bytes = 0;
+    try {
+        xm = std::make_shared<XMFile>();
+        xm->set_log(XM_LOG_NONE);
+        xm->set_load_flags(load_flags);
+        ret = xm->open_xm(path);
+        if (ret == 0) {
+            ret = xm->read_all();
+        }
+        if (ret == 0) {
+            bytes = module_bytes(xm.get());
+        }
+    } catch (...) {
+        // e.g. bad_alloc: the waiters must not block on the loading slot forever
+        guard.lock();
+        entries.erase(key);
+        stats.errors++;
+        loaded.notify_all();
+        throw;
+    }
+
+    guard.lock();
+    auto it = entries.find(key);
+    if (ret) {
+        entries.erase(it);
+        stats.errors++;
+        xm.reset();
+    } else {
+        try {
+            lru.push_front(key);
+        } catch (...) {
+            entries.erase(it);
+            stats.errors++;
+            loaded.notify_all();
+            throw;
+        }
+        it->second.xm = xm;
+        it->second.bytes = bytes;
+        it->second.loading = false;
+        it->second.lru = lru.begin();
+        stats.bytes += bytes;
+        evict();
+    }
+    loaded.notify_all();
+    if (err) *err = ret;
+    return xm;
+}
+
+void XMCache::set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    budget = bytes;
+    evict();
+}
+
+// Loads in flight finish and are cached as usual
+void XMCache::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    while (!lru.empty()) {
+        drop(entries.find(lru.back()));
+    }
+    stats.entries = 0;
+}
+
+xm_cache_stats_t XMCache::get_stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
@@ -0,0 +1,67 @@
+#ifndef XM_CACHE_H
+#define XM_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "xm_file.h"
+
+typedef struct {
+    uint64_t hits = 0;
+    uint64_t misses = 0;     // parses started
+    uint64_t merged = 0;     // requests that waited for another thread's parse of the same file
+    uint64_t evictions = 0;
+    uint64_t stale = 0;      // entries dropped because the file changed on disk
+    uint64_t errors = 0;     // failed parses, they aren't cached
+    size_t bytes = 0;        // footprint of the cached modules
+    size_t entries = 0;
+} xm_cache_stats_t;
+
+typedef struct {
+    std::shared_ptr<const XMFile> xm;
+    int64_t size = 0;        // file size and mtime at load, a change makes the entry stale
+    int64_t mtime_ns = 0;
+    size_t bytes = 0;
+    bool loading = false;
+    std::list<std::string>::iterator lru;
+} xm_cache_entry_t;
+
+// Thread-safe cache of parsed modules, keyed by path and checked against the file's size
+// and mtime on every get(). Modules are evicted least recently used first once their
+// footprint (XMFile::get_stats() resident bytes) exceeds the budget; a caller's reference
+// keeps an evicted module alive. Concurrent gets of one file share a single parse.
+// Cached modules are shared between callers, so they're loaded fully (no lazy patterns)
+// and handed out const: the const XMFile readers (peek_pattern_view(), get_instrument(),
+// find_duplicate_*(), XMPlayer, XMTimeline) keep no scratch state and can run on
+// several threads at once. Load the file into an XMFile of its own to edit it.
+class XMCache {
+private:
+    size_t budget;
+    uint32_t load_flags;
+    std::mutex lock;
+    std::condition_variable loaded;
+    std::unordered_map<std::string, xm_cache_entry_t> entries;
+    std::list<std::string> lru; // most recent first, loaded entries only
+    xm_cache_stats_t stats;
+
+    void drop(std::unordered_map<std::string, xm_cache_entry_t>::iterator it);
+    void evict();
+
+public:
+    XMCache(size_t budget_bytes, uint32_t load_flags = 0);
+
+    // NULL on failure, *err is the open_xm() / read_all() error code. An exception from the
+    // parse (bad_alloc) reaches the caller, threads waiting on the same path parse it again.
+    std::shared_ptr<const XMFile> get(const char *path, int *err = NULL);
+    void set_budget(size_t bytes);
+    void clear();
+    xm_cache_stats_t get_stats();
+};
+
+#endif
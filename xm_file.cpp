@@ -1,224 +1,1117 @@
 #include "xm_file.h"
 
-void unpack_xm_pattern(const std::vector<uint8_t>& data, std::vector<std::vector<xm_unit_t>>& unpack_data, int rows, int channels) {
-    int index = 0;
-    unpack_data.resize(channels);
-    for (int c = 0; c < channels; c++) {
-        unpack_data[c].resize(rows);
-    }
-    for (int row = 0; row < rows; ++row) {
-        for (int channel = 0; channel < channels; ++channel) {
-            xm_unit_t& current_unit = unpack_data[channel][row];
+#if defined(__unix__) || defined(__APPLE__)
+#define XM_HAVE_MMAP 1
+#define XM_HAVE_UNISTD 1
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define XM_HAVE_COPY_RANGE 1 // in-kernel copy of clean source ranges, see write_source()
+#endif
+
+#include <stdarg.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// Level test is folded at compile time against XM_LOG_MAX_LEVEL, so disabled levels cost nothing
+#define XM_LOG(level, ...) do { if (log_enabled(level)) log(level, __VA_ARGS__); } while (0)
+#define XM_LOGE(...) XM_LOG(XM_LOG_ERROR, __VA_ARGS__)
+#define XM_LOGI(...) XM_LOG(XM_LOG_INFO, __VA_ARGS__)
+#define XM_LOGD(...) XM_LOG(XM_LOG_DEBUG, __VA_ARGS__)
+
+static inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Counts a heap allocation when a buffer had to grow
+template <typename V>
+static inline uint32_t grew(const V &v, size_t old_cap) {
+    return v.capacity() > old_cap ? 1 : 0;
+}
+
+void xm_log_stdout(int level, const char *msg, void *user) {
+    (void)level;
+    (void)user;
+    fputs(msg, stdout);
+}
 
-            uint8_t mask = data[index++];
+// One bounds check per pattern: when the readable bytes cover the worst case (6 per cell)
+// the cells are decoded without checks, otherwise every byte is checked. Either way the
+// data must end exactly at the last cell.
+int unpack_xm_pattern(const uint8_t* data, size_t size, std::vector<xm_unit_t>& unpack_data, int rows, int channels, size_t readable) {
+    size_t num_cells = (size_t)rows * channels;
+    unpack_data.resize(num_cells);
+    if (size == 0) { // an all-empty pattern is stored without data
+        std::fill(unpack_data.begin(), unpack_data.end(), xm_unit_t());
+        return 0;
+    }
+    xm_unit_t *cell = unpack_data.data();
+    xm_unit_t *cell_end = cell + num_cells;
+    const uint8_t *src = data;
+    const uint8_t *src_end = data + size;
 
+    if ((readable > size ? readable : size) >= num_cells * 6) {
+        for (; cell < cell_end; ++cell) {
+            uint8_t mask = *src++;
+            cell->mask = mask;
             if (mask & 0x80) {
-                current_unit.mask = mask;
-                if (mask & 0x01) current_unit.note = data[index++];
-                else current_unit.note = 0;
-                if (mask & 0x02) current_unit.inst = data[index++];
-                else current_unit.inst = 0;
-                if (mask & 0x04) current_unit.vol = data[index++];
-                else current_unit.vol = 0;
-                if (mask & 0x08) current_unit.fx_cmd = data[index++];
-                else current_unit.fx_cmd = 0;
-                if (mask & 0x10) current_unit.fx_val = data[index++];
-                else current_unit.fx_val = 0;
+                cell->note = (mask & 0x01) ? *src++ : 0;
+                cell->inst = (mask & 0x02) ? *src++ : 0;
+                cell->vol = (mask & 0x04) ? *src++ : 0;
+                cell->fx_cmd = (mask & 0x08) ? *src++ : 0;
+                cell->fx_val = (mask & 0x10) ? *src++ : 0;
             } else {
-                current_unit.mask = mask;
-                current_unit.note = mask;
-                current_unit.inst = data[index++];
-                current_unit.vol = data[index++];
-                current_unit.fx_cmd = data[index++];
-                current_unit.fx_val = data[index++];
+                cell->note = mask;
+                cell->inst = src[0];
+                cell->vol = src[1];
+                cell->fx_cmd = src[2];
+                cell->fx_val = src[3];
+                src += 4;
             }
         }
+        return src == src_end ? 0 : FILE_READ_ERROR;
+    }
+
+    bool truncated = false;
+#define NEXT_BYTE() (src < src_end ? *src++ : (truncated = true, 0))
+    for (; cell < cell_end; ++cell) {
+        uint8_t mask = NEXT_BYTE();
+        cell->mask = mask;
+        if (mask & 0x80) {
+            cell->note = (mask & 0x01) ? NEXT_BYTE() : 0;
+            cell->inst = (mask & 0x02) ? NEXT_BYTE() : 0;
+            cell->vol = (mask & 0x04) ? NEXT_BYTE() : 0;
+            cell->fx_cmd = (mask & 0x08) ? NEXT_BYTE() : 0;
+            cell->fx_val = (mask & 0x10) ? NEXT_BYTE() : 0;
+        } else {
+            cell->note = mask;
+            cell->inst = NEXT_BYTE();
+            cell->vol = NEXT_BYTE();
+            cell->fx_cmd = NEXT_BYTE();
+            cell->fx_val = NEXT_BYTE();
+        }
     }
+#undef NEXT_BYTE
+    return truncated || src != src_end ? FILE_READ_ERROR : 0;
 }
 
-void pack_xm_pattern(std::vector<std::vector<xm_unit_t>>& unpack_data, std::vector<uint8_t>& packed_data, int rows, int channels) {
-    int index = 0;
-    for (int row = 0; row < rows; ++row) {
-        for (int channel = 0; channel < channels; ++channel) {
-            xm_unit_t& current_unit = unpack_data[channel][row];
+// Each cell gets the smaller of the two encodings: a mask byte plus the non-zero fields,
+// or the 5-byte uncompressed form when four or five fields are set (needs note < 0x80).
+void pack_xm_pattern(std::vector<xm_unit_t>& unpack_data, std::vector<uint8_t>& packed_data, int rows, int channels) {
+    size_t num_cells = (size_t)rows * channels;
+    size_t start = packed_data.size();
+    packed_data.resize(start + num_cells * 6); // worst case, a note >= 0x80 forces the 6-byte form
+    uint8_t *dst = packed_data.data() + start;
+    bool empty = true;
 
-            if (current_unit.note != 0 || current_unit.inst != 0 || current_unit.vol != 0 || current_unit.fx_cmd != 0 || current_unit.fx_val != 0) {
-                packed_data.push_back(current_unit.note);
-                current_unit.mask = current_unit.note;
-                packed_data.push_back(current_unit.inst);
-                packed_data.push_back(current_unit.vol);
-                packed_data.push_back(current_unit.fx_cmd);
-                packed_data.push_back(current_unit.fx_val);
-            } else {
-                uint8_t header = 0x80;
-
-                if (current_unit.note != 0) header |= 0x01;
-                if (current_unit.inst != 0) header |= 0x02;
-                if (current_unit.vol != 0) header |= 0x04;
-                if (current_unit.fx_cmd != 0) header |= 0x08;
-                if (current_unit.fx_val != 0) header |= 0x10;
-
-                packed_data.push_back(header);
-                unpack_data[channel][row].mask = header;
-
-                if (header & 0x01) packed_data.push_back(current_unit.note);
-                if (header & 0x02) packed_data.push_back(current_unit.inst);
-                if (header & 0x04) packed_data.push_back(current_unit.vol);
-                if (header & 0x08) packed_data.push_back(current_unit.fx_cmd);
-                if (header & 0x10) packed_data.push_back(current_unit.fx_val);
+    xm_unit_t *cell = unpack_data.data();
+    for (xm_unit_t *end = cell + num_cells; cell < end; ++cell) {
+        // Empty cells are the common case, test all five fields at once
+        uint32_t fields4;
+        memcpy(&fields4, &cell->note, 4);
+        if ((fields4 | cell->fx_val) == 0) {
+            cell->mask = 0x80;
+            *dst++ = 0x80;
+            continue;
+        }
+        empty = false;
+
+        int has_note = cell->note != 0, has_inst = cell->inst != 0, has_vol = cell->vol != 0;
+        int has_cmd = cell->fx_cmd != 0, has_val = cell->fx_val != 0;
+        uint8_t header = 0x80 | has_note | has_inst << 1 | has_vol << 2 | has_cmd << 3 | has_val << 4;
+        int fields = has_note + has_inst + has_vol + has_cmd + has_val;
+        if (fields >= 4 && cell->note < 0x80) {
+            cell->mask = cell->note;
+            dst[0] = cell->note;
+            dst[1] = cell->inst;
+            dst[2] = cell->vol;
+            dst[3] = cell->fx_cmd;
+            dst[4] = cell->fx_val;
+            dst += 5;
+        } else {
+            // Branchless: every field is stored, the cursor only advances past the present ones
+            cell->mask = header;
+            *dst++ = header;
+            *dst = cell->note;
+            dst += has_note;
+            *dst = cell->inst;
+            dst += has_inst;
+            *dst = cell->vol;
+            dst += has_vol;
+            *dst = cell->fx_cmd;
+            dst += has_cmd;
+            *dst = cell->fx_val;
+            dst += has_val;
+        }
+    }
+
+    // An all-empty pattern is stored with no data (packedPatternSize = 0)
+    packed_data.resize(empty ? start : dst - packed_data.data());
+}
+
+size_t xm_sample_length(const xm_sample_t *smp) {
+    if (!smp->adpcm.empty()) {
+        return smp->length;
+    }
+    return smp->type.sample_bit ? smp->data.size() : smp->data8.size();
+}
+
+int16_t xm_sample_get(const xm_sample_t *smp, size_t pos) {
+    if (smp->type.sample_bit) {
+        return smp->data[pos];
+    }
+    if (!smp->adpcm.empty()) {
+        int8_t val;
+        xm_sample_decode(smp, pos, &val, 1);
+        return (int16_t)(val * 256);
+    }
+    return (int16_t)(smp->data8[pos] * 256);
+}
+
+// 8-bit samples keep the high byte of val, packed and shared samples get their own copy first
+void xm_sample_set(xm_sample_t *smp, size_t pos, int16_t val) {
+    xm_sample_unpack(smp);
+    smp->play = NULL;
+    smp->dirty = true;
+    if (smp->shared) {
+        smp->data.detach();
+        smp->data8.detach();
+        smp->shared = false;
+        smp->hold.reset();
+    }
+    if (smp->type.sample_bit) {
+        smp->data[pos] = val;
+    } else {
+        smp->data8[pos] = (int8_t)(val >> 8);
+    }
+}
+
+void xm_sample_to_16bit(xm_sample_t *smp) {
+    if (smp->type.sample_bit) {
+        return;
+    }
+    xm_sample_unpack(smp);
+    smp->play = NULL;
+    smp->dirty = true;
+    smp->data.resize(smp->data8.size());
+    for (size_t i = 0; i < smp->data8.size(); i++) {
+        smp->data[i] = (int16_t)(smp->data8[i] * 256);
+    }
+    smp->data8.release();
+    smp->hold.reset();
+    smp->type.sample_bit = 1;
+}
+
+void xm_sample_to_8bit(xm_sample_t *smp) {
+    if (!smp->type.sample_bit) {
+        return;
+    }
+    smp->play = NULL;
+    smp->dirty = true;
+    smp->data8.resize(smp->data.size());
+    for (size_t i = 0; i < smp->data.size(); i++) {
+        smp->data8[i] = (int8_t)(smp->data[i] >> 8);
+    }
+    smp->data.release();
+    smp->hold.reset();
+    smp->type.sample_bit = 0;
+}
+
+bool xm_sample_is_packed(const xm_sample_t *smp) {
+    return !smp->adpcm.empty();
+}
+
+// Starts at the key of pos's block, so any position costs at most XM_ADPCM_BLOCK extra steps
+void xm_sample_decode(const xm_sample_t *smp, size_t pos, int8_t *out, size_t count) {
+    size_t length = smp->length;
+    if (smp->adpcm.empty() || pos >= length) {
+        return;
+    }
+    count = count < length - pos ? count : length - pos;
+    const int8_t *table = (const int8_t *)smp->adpcm.data();
+    const uint8_t *nibbles = smp->adpcm.data() + 16;
+    size_t block = pos / XM_ADPCM_BLOCK;
+    int8_t acc = smp->adpcm_keys[block];
+    for (size_t i = block * XM_ADPCM_BLOCK; i < pos; i++) {
+        acc += table[(nibbles[i >> 1] >> ((i & 1) * 4)) & 0x0F];
+    }
+    decode_adpcm_4bit(nibbles, table, acc, pos, out, count);
+}
+
+void xm_sample_unpack(xm_sample_t *smp) {
+    if (smp->adpcm.empty()) {
+        return;
+    }
+    smp->data8.resize(smp->length);
+    decode_adpcm_4bit(smp->adpcm.data() + 16, (const int8_t *)smp->adpcm.data(), 0, 0, smp->data8.data(), smp->length);
+    std::vector<uint8_t>().swap(smp->adpcm);
+    std::vector<int8_t>().swap(smp->adpcm_keys);
+}
+
+static void adpcm_build_keys(xm_sample_t *smp) {
+    const int8_t *table = (const int8_t *)smp->adpcm.data();
+    const uint8_t *nibbles = smp->adpcm.data() + 16;
+    smp->adpcm_keys.resize(smp->length / XM_ADPCM_BLOCK + 1);
+    int8_t acc = 0;
+    for (size_t i = 0; i < smp->length; i++) {
+        if (i % XM_ADPCM_BLOCK == 0) {
+            smp->adpcm_keys[i / XM_ADPCM_BLOCK] = acc;
+        }
+        acc += table[(nibbles[i >> 1] >> ((i & 1) * 4)) & 0x0F];
+    }
+}
+
+void XMFile::log(int level, const char *fmt, ...) const {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    log_cb(level, msg, log_user);
+}
+
+void XMFile::set_log(int level, xm_log_cb_t cb, void *user) {
+    log_level = level;
+    log_cb = cb;
+    log_user = user;
+}
+
+void XMFile::dump_envelope(const char *name, const env_point_t *env, uint8_t num, env_type_t type,
+                           uint8_t sus, uint8_t loop_start, uint8_t loop_end, const std::vector<int16_t> &table) {
+    XM_LOGD("%s (%s):\n", name, type.on ? "ON" : "OFF");
+    if (num == 0) {
+        return;
+    }
+    XM_LOGD("XXXX -> YYYY\n");
+    for (int n = 0; n < num && n < 12; n++) {
+        XM_LOGD("%4d -> %4d ", env[n].x, env[n].y);
+        if (type.loop) {
+            if (n == loop_start) {
+                XM_LOGD("<-LOOPSTART ");
+            }
+            if (n == loop_end) {
+                XM_LOGD("<-LOOPEND ");
             }
         }
+        if (type.sus && n == sus) {
+            XM_LOGD("<-SUSTIAN");
+        }
+        XM_LOGD("\n");
+    }
+    if (table.empty()) {
+        return;
     }
+    XM_LOGD("LUT:\n");
+    for (size_t x = 0; x < table.size(); x++) {
+        XM_LOGD("%d ", table[x]);
+    }
+    XM_LOGD("\n");
+}
+
+const uint8_t *XMFile::read_ptr(size_t len) {
+    if (src_data == NULL || len > src_size - src_pos) {
+        return NULL;
+    }
+    const uint8_t *p = src_data + src_pos;
+    src_pos += len;
+    return p;
+}
+
+int XMFile::read_bytes(void *dst, size_t len) {
+    const uint8_t *p = read_ptr(len);
+    if (p == NULL) {
+        return FILE_READ_ERROR;
+    }
+    memcpy(dst, p, len);
+    return 0;
 }
 
 int XMFile::read_metadata() {
-    fread(metadata.id, 1, 17, xm_file);
-    fread(metadata.name, 1, 20, xm_file);
-    fread(&metadata.X1A, 1, 1, xm_file);
+    if (read_bytes(metadata.id, 17) || read_bytes(metadata.name, 20) || read_bytes(&metadata.X1A, 1)) {
+        XM_LOGE("Metadata Error! File too short\n");
+        return FILE_TYPE_ERROR;
+    }
     if (metadata.X1A != 0x1A) {
-        printf("Metadata Error! X1A = 0x%X\n", metadata.X1A);
+        XM_LOGE("Metadata Error! X1A = 0x%X\n", metadata.X1A);
+        return FILE_TYPE_ERROR;
+    }
+    if (read_bytes(metadata.trkname, 20) || read_bytes(&metadata.version, 2)) {
+        XM_LOGE("Metadata Error! File too short\n");
         return FILE_TYPE_ERROR;
     }
-    fread(metadata.trkname, 1, 20, xm_file);
-    fread(&metadata.version, 2, 1, xm_file);
 
-    printf("Metadata:\n");
-    printf("ID: %.17s\n", metadata.id);
-    printf("Name: %.20s\n", metadata.name);
-    printf("X1A: 0x%X\n", metadata.X1A);
-    printf("Tracker name: %.20s\n", metadata.trkname);
-    printf("Version: 0x%X\n", metadata.version);
-    printf("\n");
+    XM_LOGD("Metadata:\n");
+    XM_LOGD("ID: %.17s\n", metadata.id);
+    XM_LOGD("Name: %.20s\n", metadata.name);
+    XM_LOGD("X1A: 0x%X\n", metadata.X1A);
+    XM_LOGD("Tracker name: %.20s\n", metadata.trkname);
+    XM_LOGD("Version: 0x%X\n", metadata.version);
+    XM_LOGD("\n");
     return 0;
 }
 
 void XMFile::write_metadata() {
-    printf("Writing metadata...\n");
-    fwrite(metadata.id, 1, 17, xm_file);
-    fwrite(metadata.name, 1, 20, xm_file);
-    fwrite(&metadata.X1A, 1, 1, xm_file);
-    fwrite(metadata.trkname, 1, 20, xm_file);
-    fwrite(&metadata.version, 2, 1, xm_file);
+    XM_LOGI("Writing metadata...\n");
+    write_bytes(metadata.id, 17);
+    write_bytes(metadata.name, 20);
+    write_bytes(&metadata.X1A, 1);
+    write_bytes(metadata.trkname, 20);
+    write_bytes(&metadata.version, 2);
 }
 
-int XMFile::open_xm(const char* filename) {
-    xm_file = fopen(filename, "rb");
-    if (xm_file == NULL) {
-        return FILE_OPEN_ERROR;
+XMFile::~XMFile() {
+    close_xm();
+}
+
+// Owned PCM moves into a holder both modules reference, then every sample with PCM is
+// marked shared so whichever side edits it through xm_sample_*() copies it out first
+XMFile XMFile::clone() {
+    XMFile copy;
+    memcpy(copy.xm_file_name, xm_file_name, sizeof(xm_file_name));
+    copy.load_flags = load_flags;
+    copy.save_flags = save_flags;
+    copy.probed = probed;
+    copy.load_threads = load_threads;
+    copy.log_level = log_level;
+    copy.log_cb = log_cb;
+    copy.log_user = log_user;
+    copy.metadata = metadata;
+    copy.header = header;
+    copy.pattern = pattern;
+    copy.sample_arena = sample_arena;
+    copy.sample_arena_size = sample_arena_size;
+    copy.cache_map = cache_map;
+    copy.orig_hold = orig_hold;
+    copy.orig_data = orig_data;
+    copy.orig_size = orig_size;
+    copy.orig_fd = orig_fd;
+    for (size_t i = 0; i < instrument.size(); i++) {
+        for (size_t n = 0; n < instrument[i].sample.size(); n++) {
+            xm_sample_t *smp = &instrument[i].sample[n];
+            if (smp->data.capacity()) {
+                smp->hold.reset(smp->data.disown(), free);
+            } else if (smp->data8.capacity()) {
+                smp->hold.reset(smp->data8.disown(), free);
+            }
+            if (!smp->data.empty() || !smp->data8.empty()) {
+                smp->shared = true;
+            }
+        }
     }
-    
-    if (read_metadata() == FILE_TYPE_ERROR) {
+    copy.instrument = instrument;
+    return copy;
+}
+
+void XMFile::begin_load() {
+    close_xm();
+    orig_hold.reset();
+    orig_data = NULL;
+    orig_size = 0;
+    orig_fd.reset();
+    stats.metadata_ns = stats.header_ns = stats.patterns_ns = stats.instruments_ns = 0;
+    stats.sample_decode_ns = stats.parallel_ns = stats.load_ns = 0;
+    stats.bytes_read = 0;
+    stats.read_calls = stats.load_allocs = 0;
+    stats.dedup_samples = 0;
+    stats.dedup_bytes = 0;
+    load_start = now_ns();
+}
+
+int XMFile::attach_source(const char* filename) {
+    src_pos = 0;
+    stats.bytes_read = src_size;
+    int ret = read_metadata();
+    stats.metadata_ns = now_ns() - load_start;
+    if (ret == FILE_TYPE_ERROR) {
         close_xm();
         xm_metadata_t new_meta;
         metadata = new_meta;
         return FILE_TYPE_ERROR;
     }
 
-    strncpy(xm_file_name, filename, sizeof(xm_file_name));
+    if (filename) {
+        strncpy(xm_file_name, filename, sizeof(xm_file_name) - 1);
+        xm_file_name[sizeof(xm_file_name) - 1] = '\0';
+    } else {
+        xm_file_name[0] = '\0';
+    }
     return 0;
 }
 
+#ifdef XM_HAVE_UNISTD
+static std::shared_ptr<int> share_fd(int fd) {
+    if (fd < 0) {
+        return NULL;
+    }
+    return std::shared_ptr<int>(new int(fd), [](int *p) {
+        close(*p);
+        delete p;
+    });
+}
+#endif
+
+// Whole file is pulled in with a single fread, everything after that is parsed from memory
+int XMFile::open_xm(const char* filename) {
+    begin_load();
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (file_size < 0) {
+        fclose(f);
+        return FILE_OPEN_ERROR;
+    }
+    size_t cap = src_buf.capacity();
+    src_buf.resize(file_size);
+    stats.load_allocs += grew(src_buf, cap);
+    size_t got = fread(src_buf.data(), 1, file_size, f);
+#ifdef XM_HAVE_UNISTD
+    if (load_flags & XM_LOAD_KEEP_SOURCE) {
+        orig_fd = share_fd(dup(fileno(f)));
+    }
+#endif
+    fclose(f);
+    stats.read_calls++;
+
+    src_data = src_buf.data();
+    src_size = got;
+    return attach_source(filename);
+}
+
+// Parse straight out of the page cache, no copy of the file is made
+int XMFile::open_xm_mmap(const char* filename) {
+#ifdef XM_HAVE_MMAP
+    begin_load();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return FILE_OPEN_ERROR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return FILE_OPEN_ERROR;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED && (load_flags & XM_LOAD_KEEP_SOURCE)) {
+        orig_fd = share_fd(fd);
+    } else {
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        return FILE_OPEN_ERROR;
+    }
+    // A probe touches a few header pages, readahead would pull in the sample data too
+    madvise(map, st.st_size, (load_flags & XM_LOAD_PROBE) ? MADV_RANDOM : MADV_SEQUENTIAL);
+    stats.read_calls++;
+
+    size_t map_size = st.st_size;
+    src_map.reset(map, [map_size](void *p) { munmap(p, map_size); });
+    src_data = (const uint8_t *)map;
+    src_size = st.st_size;
+    return attach_source(filename);
+#else
+    return open_xm(filename);
+#endif
+}
+
+// The buffer is borrowed, it must stay valid until read_all() returns
+int XMFile::open_xm_memory(const uint8_t* data, size_t size) {
+    begin_load();
+    if (data == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    src_data = data;
+    src_size = size;
+    return attach_source(NULL);
+}
+
+int XMFile::load_from_memory(const uint8_t* data, size_t size) {
+    int ret = open_xm_memory(data, size);
+    if (ret) {
+        return ret;
+    }
+    return read_all();
+}
+
+// Names, counts and sample headers at I/O speed: only the header pages of the file are read
+int XMFile::probe_xm(const char* filename) {
+    uint32_t flags = load_flags;
+    load_flags |= XM_LOAD_PROBE;
+    int ret = open_xm_mmap(filename);
+    if (ret == 0) {
+        ret = read_all();
+    }
+    load_flags = flags;
+    return ret;
+}
+
 void XMFile::close_xm() {
-    fclose(xm_file);
+    src_map.reset();
+    if (load_flags & XM_LOAD_KEEP_BUFFERS) {
+        src_buf.clear();
+    } else {
+        std::vector<uint8_t>().swap(src_buf);
+    }
+    src_data = NULL;
+    src_size = 0;
+    src_pos = 0;
 }
 
 int XMFile::read_header() {
-    if (ftell(xm_file) != 60) {
-        printf("Order Error! ftell(xm_file) = 0x%X(%d)\n", ftell(xm_file), ftell(xm_file));
+    if (src_pos != 60) {
+        XM_LOGE("Order Error! src_pos = 0x%zX(%zu)\n", src_pos, src_pos);
         return FILE_READ_ERROR;
     }
 
-    printf("Reading Info...\n");
-    fread(&header, 2, 10, xm_file);
-    printf("Reading OrderTable...\n");
+    XM_LOGI("Reading Info...\n");
+    if (read_bytes(&header, 20)) {
+        return FILE_READ_ERROR;
+    }
+    XM_LOGI("Reading OrderTable...\n");
+    if (header.size < 20 || header.size - 20 > src_size - src_pos) { // before the order table is sized from it
+        XM_LOGE("Header Error! size = %u\n", header.size);
+        return FILE_READ_ERROR;
+    }
+    size_t cap = header.orderTable.capacity();
     header.orderTable.resize(header.size - 20);
-    fread(header.orderTable.data(), 1, header.size - 20, xm_file);
-    printf("Header Info:\n");
-    printf("Size: %d\n", header.size);
-    printf("Song length: %d\n", header.songLength);
-    printf("Restart position: %d\n", header.resetVector);
-    printf("Number of channels: %d\n", header.numChannels);
-    printf("Number of patterns: %d\n", header.numPatterns);
-    printf("Number of instruments: %d\n", header.numInstruments);
-    printf("Freq mode: %s\n", header.freqMode ? "Liner" : "Amiga");
-    printf("Default Tempo: %d\n", header.defaultTempo);
-    printf("Default BPM: %d\n", header.defaultBPM);
-    printf("Order table:\n");
-    for (int i = 0; i < header.songLength; i++) {
-        printf("%d ", header.orderTable[i]);
-    }
-    printf("\n\n");
+    stats.load_allocs += grew(header.orderTable, cap);
+    if (read_bytes(header.orderTable.data(), header.size - 20)) {
+        return FILE_READ_ERROR;
+    }
+    if (header.songLength > header.orderTable.size()) {
+        header.songLength = header.orderTable.size();
+    }
+    XM_LOGD("Header Info:\n");
+    XM_LOGD("Size: %d\n", header.size);
+    XM_LOGD("Song length: %d\n", header.songLength);
+    XM_LOGD("Restart position: %d\n", header.resetVector);
+    XM_LOGD("Number of channels: %d\n", header.numChannels);
+    XM_LOGD("Number of patterns: %d\n", header.numPatterns);
+    XM_LOGD("Number of instruments: %d\n", header.numInstruments);
+    XM_LOGD("Freq mode: %s\n", header.freqMode ? "Liner" : "Amiga");
+    XM_LOGD("Default Tempo: %d\n", header.defaultTempo);
+    XM_LOGD("Default BPM: %d\n", header.defaultBPM);
+    if (log_enabled(XM_LOG_DEBUG)) {
+        XM_LOGD("Order table:\n");
+        for (int i = 0; i < header.songLength; i++) {
+            XM_LOGD("%d ", header.orderTable[i]);
+        }
+        XM_LOGD("\n\n");
+    }
     return 0;
 }
 
 void XMFile::write_header() {
-    size_t total_size = 20;
-    printf("Writing header...\n");
-    size_t block_start_addr = ftell(xm_file);
-    fwrite(&header, 2, 10, xm_file);
-    printf("Writing orderTable...(%d Bytes)\n", header.orderTable.size());
-    total_size += header.orderTable.size();
-    fwrite(header.orderTable.data(), 1, header.orderTable.size(), xm_file);
-    size_t block_end_addr = ftell(xm_file);
-    header.size = total_size;
-    fseek(xm_file, block_start_addr, SEEK_SET);
-    fwrite(&header.size, 4, 1, xm_file);
-    fseek(xm_file, block_end_addr, SEEK_SET);
-}
-
-void XMFile::read_patterns() {
-    printf("Reading patterns...\n");
+    XM_LOGI("Writing header...\n");
+    header.size = 20 + header.orderTable.size();
+    if (save_pattern_map.empty()) {
+        write_bytes(&header, 20);
+        XM_LOGD("Writing orderTable...(%zu Bytes)\n", header.orderTable.size());
+        write_bytes(header.orderTable.data(), header.orderTable.size());
+        return;
+    }
+    uint16_t num_patterns = header.numPatterns;
+    header.numPatterns = 0;
+    for (size_t i = 0; i < save_pattern_map.size(); i++) {
+        header.numPatterns += save_pattern_map[i] == header.numPatterns;
+    }
+    write_bytes(&header, 20);
+    header.numPatterns = num_patterns;
+    XM_LOGD("Writing remapped orderTable...(%zu Bytes)\n", header.orderTable.size());
+    for (size_t i = 0; i < header.orderTable.size(); i++) {
+        uint8_t order = header.orderTable[i];
+        if (order < save_pattern_map.size()) {
+            order = save_pattern_map[order];
+        }
+        write_bytes(&order, 1);
+    }
+}
+
+int XMFile::read_patterns() {
+    XM_LOGI("Reading patterns...\n");
+    size_t cap = pattern.capacity();
     pattern.resize(header.numPatterns);
+    stats.load_allocs += grew(pattern, cap);
     for (int i = 0; i < header.numPatterns; i++) {
-        printf("Patterm #%d:\n", i);
-        fread(&pattern[i].headerLength, 4, 1, xm_file);
-        printf("Header length: %d\n", pattern[i].headerLength);
-        fread(&pattern[i].type, 1, 1, xm_file);
-        printf("Type: %d\n", pattern[i].type);
-        fread(&pattern[i].numRows, 2, 1, xm_file);
-        printf("Number of rows: %d\n", pattern[i].numRows);
-        fread(&pattern[i].packedPatternSize, 2, 1, xm_file);
-        printf("Pattern data size: %d\n", pattern[i].packedPatternSize);
-        fseek(xm_file, 9 - pattern[i].headerLength, SEEK_CUR);
-        printf("Reading pattern data...\n");
-        std::vector<uint8_t> packed_pattern(pattern[i].packedPatternSize);
-        fread(packed_pattern.data(), 1, pattern[i].packedPatternSize, xm_file);
-        printf("Unpack pattern data...\n");
-        unpack_xm_pattern(packed_pattern, pattern[i].unpk_pattern, pattern[i].numRows, header.numChannels);
-        printf("\n");
+        XM_LOGD("Patterm #%d:\n", i);
+        if (!pattern[i] || pattern[i].use_count() > 1) { // a clone keeps the old one
+            pattern[i] = std::make_shared<xm_pattern_t>();
+            stats.load_allocs++;
+        }
+        size_t start_pos = src_pos;
+        if (read_bytes(&pattern[i]->headerLength, 4) || read_bytes(&pattern[i]->type, 1) ||
+            read_bytes(&pattern[i]->numRows, 2) || read_bytes(&pattern[i]->packedPatternSize, 2)) {
+            return FILE_READ_ERROR;
+        }
+        XM_LOGD("Header length: %d\n", pattern[i]->headerLength);
+        XM_LOGD("Type: %d\n", pattern[i]->type);
+        XM_LOGD("Number of rows: %d\n", pattern[i]->numRows);
+        XM_LOGD("Pattern data size: %d\n", pattern[i]->packedPatternSize);
+        if (pattern[i]->headerLength > src_size - start_pos) {
+            return FILE_READ_ERROR;
+        }
+        src_pos = start_pos + pattern[i]->headerLength;
+        XM_LOGD("Reading pattern data...\n");
+        pattern[i]->fileOffset = src_pos;
+        pattern[i]->fileSize = pattern[i]->packedPatternSize;
+        pattern[i]->dirty = !(load_flags & XM_LOAD_KEEP_SOURCE);
+        const uint8_t *packed_pattern = read_ptr(pattern[i]->packedPatternSize);
+        if (packed_pattern == NULL) {
+            return FILE_READ_ERROR;
+        }
+        if (load_flags & XM_LOAD_PROBE) {
+            pattern[i]->packed.clear();
+            pattern[i]->unpk_pattern.clear();
+            pattern[i]->unpacked = false;
+        } else if (load_flags & XM_LOAD_LAZY_PATTERNS) {
+            size_t packed_cap = pattern[i]->packed.capacity();
+            pattern[i]->packed.assign(packed_pattern, packed_pattern + pattern[i]->packedPatternSize);
+            stats.load_allocs += grew(pattern[i]->packed, packed_cap);
+            pattern[i]->unpk_pattern.clear();
+            pattern[i]->unpacked = false;
+        } else {
+            XM_LOGD("Unpack pattern data...\n");
+            xm_load_job_t job = {packed_pattern, pattern[i]->packedPatternSize, pattern[i].get(), NULL};
+            job.readable = src_size - pattern[i]->fileOffset; // the rest of the file follows
+            add_load_job(job);
+            pattern[i]->packed.clear();
+            pattern[i]->unpacked = true;
+        }
+        XM_LOGD("\n");
     }
+    return 0;
 }
 
+// Each pattern is packed before its header goes out, so packedPatternSize is known up front
 void XMFile::write_patterns() {
-    printf("Writing patterns...\n");
+    XM_LOGI("Writing patterns...\n");
     header.numPatterns = pattern.size();
+    uint16_t written = 0;
     for (int i = 0; i < header.numPatterns; i++) {
-        size_t total_size = 0;
-        size_t start_addr = ftell(xm_file);
-        printf("Writing patterm #%d...\n", i);
-        fwrite(&pattern[i].headerLength, 4, 1, xm_file);
-        total_size += 4;
-        fwrite(&pattern[i].type, 1, 1, xm_file);
-        total_size += 1;
-        fwrite(&pattern[i].numRows, 2, 1, xm_file);
-        total_size += 2;
-        std::vector<uint8_t> packed_pattern;
-        pack_xm_pattern(pattern[i].unpk_pattern, packed_pattern, pattern[i].numRows, header.numChannels);
-        size_t packed_data_size = packed_pattern.size();
-        pattern[i].packedPatternSize = packed_data_size;
-        fwrite(&pattern[i].packedPatternSize, 2, 1, xm_file);
-        total_size += 2;
-        fwrite(packed_pattern.data(), 1, packed_data_size, xm_file);
-        printf("Packed data size: %d\n", packed_data_size);
-        size_t end_addr = ftell(xm_file);
-        fseek(xm_file, start_addr, SEEK_SET);
-        pattern[i].headerLength = total_size;
-        fwrite(&pattern[i].headerLength, 4, 1, xm_file);
-        fseek(xm_file, end_addr, SEEK_SET);
+        // A duplicate maps to an index that was already written
+        if (!save_pattern_map.empty() && save_pattern_map[i] != written) {
+            continue;
+        }
+        written++;
+        XM_LOGD("Writing patterm #%d...\n", i);
+        if (!pattern[i]->dirty && orig_data) { // unedited, the source bytes are still its packed form
+            pattern[i]->headerLength = 9;
+            pattern[i]->packedPatternSize = pattern[i]->fileSize;
+            write_bytes(&pattern[i]->headerLength, 4);
+            write_bytes(&pattern[i]->type, 1);
+            write_bytes(&pattern[i]->numRows, 2);
+            write_bytes(&pattern[i]->packedPatternSize, 2);
+            write_source(pattern[i]->fileOffset, pattern[i]->fileSize);
+            continue;
+        }
+        const std::vector<uint8_t> *packed_pattern = &pattern[i]->packed; // never unpacked, still byte-identical to the source
+        if (pattern[i]->unpacked) {
+            uint64_t t0 = now_ns();
+            size_t cap = enc_buf.capacity();
+            enc_buf.clear();
+            pack_xm_pattern(pattern[i]->unpk_pattern, enc_buf, pattern[i]->numRows, header.numChannels);
+            packed_pattern = &enc_buf;
+            stats.save_allocs += grew(enc_buf, cap);
+            stats.encode_ns += now_ns() - t0;
+        }
+        pattern[i]->headerLength = 9;
+        pattern[i]->packedPatternSize = packed_pattern->size();
+        write_bytes(&pattern[i]->headerLength, 4);
+        write_bytes(&pattern[i]->type, 1);
+        write_bytes(&pattern[i]->numRows, 2);
+        write_bytes(&pattern[i]->packedPatternSize, 2);
+        write_bytes(packed_pattern->data(), packed_pattern->size());
+        XM_LOGD("Packed data size: %zu\n", packed_pattern->size());
+    }
+}
+
+// Load/save counters are kept as they go, the resident sizes are summed here
+const xm_stats_t &XMFile::get_stats() {
+    stats.pattern_bytes = pattern.capacity() * sizeof(pattern[0]);
+    for (size_t i = 0; i < pattern.size(); i++) {
+        stats.pattern_bytes += sizeof(xm_pattern_t) + pattern[i]->unpk_pattern.capacity() * sizeof(xm_unit_t) + pattern[i]->packed.capacity();
+    }
+    stats.sample_bytes = sample_arena_size;
+    stats.envelope_bytes = 0;
+    for (size_t i = 0; i < instrument.size(); i++) {
+        const xm_instrument_t &inst = instrument[i];
+        stats.sample_bytes += inst.sample.capacity() * sizeof(xm_sample_t);
+        for (size_t n = 0; n < inst.sample.size(); n++) {
+            const xm_sample_t &smp = inst.sample[n];
+            stats.sample_bytes += smp.data.capacity() * 2 + smp.data8.capacity() + smp.adpcm.capacity() + smp.adpcm_keys.capacity();
+        }
+        stats.envelope_bytes += (inst.volEnvTable.capacity() + inst.panEnvTable.capacity()) * sizeof(int16_t);
+    }
+    stats.buffer_bytes = src_buf.capacity() + load_jobs.capacity() * sizeof(xm_load_job_t) +
+                         dedup_keys.capacity() * sizeof(dedup_keys[0]) + dedup_links.capacity() * sizeof(dedup_links[0]) +
+                         (pattern_scratch[0].capacity() + pattern_scratch[1].capacity()) * sizeof(xm_unit_t) +
+                         save_pattern_map.capacity() * sizeof(uint16_t) + out_buf.capacity() + enc_buf.capacity() + orig_size;
+    return stats;
+}
+
+void xm_stats_foreach(const xm_stats_t *stats, void (*cb)(const char *name, uint64_t value, void *user), void *user) {
+#define XM_STAT(field) cb(#field, stats->field, user)
+    XM_STAT(metadata_ns);
+    XM_STAT(header_ns);
+    XM_STAT(patterns_ns);
+    XM_STAT(instruments_ns);
+    XM_STAT(sample_decode_ns);
+    XM_STAT(parallel_ns);
+    XM_STAT(load_ns);
+    XM_STAT(bytes_read);
+    XM_STAT(read_calls);
+    XM_STAT(load_allocs);
+    XM_STAT(dedup_samples);
+    XM_STAT(dedup_bytes);
+    XM_STAT(encode_ns);
+    XM_STAT(write_ns);
+    XM_STAT(save_ns);
+    XM_STAT(bytes_written);
+    XM_STAT(write_calls);
+    XM_STAT(save_allocs);
+    XM_STAT(copied_bytes);
+    XM_STAT(pattern_bytes);
+    XM_STAT(sample_bytes);
+    XM_STAT(envelope_bytes);
+    XM_STAT(buffer_bytes);
+#undef XM_STAT
+}
+
+void XMFile::set_load_flags(uint32_t flags) {
+    load_flags = flags;
+}
+
+void XMFile::set_save_flags(uint32_t flags) {
+    save_flags = flags;
+}
+
+// 0 = one thread per core, 1 = decode on the calling thread (default)
+void XMFile::set_load_threads(unsigned int threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    load_threads = threads ? threads : 1;
+}
+
+const xm_metadata_t *XMFile::get_metadata() const {
+    return &metadata;
+}
+
+const xm_header_t *XMFile::get_header() const {
+    return &header;
+}
+
+uint16_t XMFile::get_num_instruments() const {
+    return instrument.size();
+}
+
+xm_instrument_t *XMFile::get_instrument(uint16_t num) {
+    if (num >= instrument.size()) {
+        return NULL;
+    }
+    return &instrument[num];
+}
+
+const xm_instrument_t *XMFile::get_instrument(uint16_t num) const {
+    if (num >= instrument.size()) {
+        return NULL;
+    }
+    return &instrument[num];
+}
+
+uint16_t XMFile::get_num_patterns() const {
+    return pattern.size();
+}
+
+// Lazy patterns are validated here, a corrupt one stays packed and reads as missing
+bool XMFile::unpack_pattern(xm_pattern_t *pat) {
+    if (unpack_xm_pattern(pat->packed.data(), pat->packed.size(), pat->unpk_pattern, pat->numRows, header.numChannels)) {
+        XM_LOGE("Corrupt pattern data\n");
+        pat->unpk_pattern.clear();
+        return false;
+    }
+    pat->unpacked = true;
+    return true;
+}
+
+xm_pattern_t *XMFile::get_pattern(uint16_t num) {
+    if (num >= pattern.size()) {
+        return NULL;
+    }
+    if (probed) {
+        return NULL; // the cells were never read
+    }
+    if (pattern[num].use_count() > 1) {
+        pattern[num] = std::make_shared<xm_pattern_t>(*pattern[num]);
+    }
+    xm_pattern_t *pat = pattern[num].get();
+    if (!pat->unpacked && !unpack_pattern(pat)) {
+        return NULL;
+    }
+    pat->dirty = true; // the caller may write the cells
+    return pat;
+}
+
+bool XMFile::is_pattern_dirty(uint16_t num) const {
+    return num < pattern.size() && pattern[num]->dirty;
+}
+
+xm_pattern_view_t XMFile::get_pattern_view(uint16_t num) {
+    xm_pattern_view_t view;
+    xm_pattern_t *pat = get_pattern(num);
+    if (pat) {
+        view.cells = pat->unpk_pattern.data();
+        view.rows = pat->numRows;
+        view.channels = header.numChannels;
+    }
+    return view;
+}
+
+// Unpacking in place doesn't change the cells, so a pattern shared with clones stays shared
+xm_pattern_cview_t XMFile::peek_pattern_view(uint16_t num) {
+    if (num < pattern.size() && !probed && !pattern[num]->unpacked) {
+        unpack_pattern(pattern[num].get());
+    }
+    return static_cast<const XMFile *>(this)->peek_pattern_view(num);
+}
+
+xm_pattern_cview_t XMFile::peek_pattern_view(uint16_t num) const {
+    xm_pattern_cview_t view;
+    if (num >= pattern.size() || probed || !pattern[num]->unpacked) {
+        return view;
+    }
+    const xm_pattern_t *pat = pattern[num].get();
+    view.cells = pat->unpk_pattern.data();
+    view.rows = pat->numRows;
+    view.channels = header.numChannels;
+    return view;
+}
+
+// Drop the unpacked cells, keeping (or producing) the packed form so the next get_pattern() can restore them
+void XMFile::evict_pattern(uint16_t num) {
+    if (num >= pattern.size() || !pattern[num]->unpacked) {
+        return;
+    }
+    if (pattern[num].use_count() > 1) { // the clones may still be reading the cells
+        pattern[num] = std::make_shared<xm_pattern_t>(*pattern[num]);
+    }
+    xm_pattern_t *pat = pattern[num].get();
+    pat->packed.clear();
+    pack_xm_pattern(pat->unpk_pattern, pat->packed, pat->numRows, header.numChannels);
+    pat->packedPatternSize = pat->packed.size();
+    std::vector<xm_unit_t>().swap(pat->unpk_pattern);
+    pat->unpacked = false;
+}
+
+// The mask byte only records how the source was packed, it isn't compared
+static uint64_t hash_cells(const xm_unit_t *cells, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = (uint64_t)cells[i].note | (uint64_t)cells[i].inst << 8 | (uint64_t)cells[i].vol << 16 |
+                     (uint64_t)cells[i].fx_cmd << 24 | (uint64_t)cells[i].fx_val << 32;
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static bool same_cells(const xm_unit_t *a, const xm_unit_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i].note != b[i].note || a[i].inst != b[i].inst || a[i].vol != b[i].vol ||
+            a[i].fx_cmd != b[i].fx_cmd || a[i].fx_val != b[i].fx_val) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const xm_unit_t *XMFile::pattern_cells(uint16_t num, std::vector<xm_unit_t> &scratch) const {
+    const xm_pattern_t *pat = pattern[num].get();
+    if (pat->unpacked) {
+        return pat->unpk_pattern.data();
+    }
+    if (unpack_xm_pattern(pat->packed.data(), pat->packed.size(), scratch, pat->numRows, header.numChannels)) {
+        return NULL;
+    }
+    return scratch.data();
+}
+
+// Without cells (or PCM, for instruments) everything would compare equal, so a probed
+// module gets the identity map
+static uint16_t identity_map(std::vector<uint16_t> &map, size_t n) {
+    map.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        map[i] = i;
+    }
+    return 0;
+}
+
+// Buffers come from the caller: the save path reuses its own, the public one is reentrant
+uint16_t XMFile::find_duplicate_patterns(std::vector<uint16_t> &map) const {
+    std::vector<std::pair<uint64_t, uint32_t> > keys;
+    std::vector<xm_unit_t> scratch[2];
+    return find_duplicate_patterns(map, keys, scratch);
+}
+
+uint16_t XMFile::find_duplicate_patterns(std::vector<uint16_t> &map, std::vector<std::pair<uint64_t, uint32_t> > &keys,
+                                         std::vector<xm_unit_t> *scratch) const {
+    if (probed) {
+        return identity_map(map, pattern.size());
+    }
+    map.resize(pattern.size());
+    keys.clear();
+    for (size_t i = 0; i < pattern.size(); i++) {
+        map[i] = i;
+        size_t cells = (size_t)pattern[i]->numRows * header.numChannels;
+        const xm_unit_t *data = pattern_cells(i, scratch[0]);
+        if (data == NULL) {
+            continue; // corrupt, never a duplicate
+        }
+        uint64_t h = hash_cells(data, cells) ^ pattern[i]->numRows * 0x9E3779B97F4A7C15ull;
+        keys.push_back(std::make_pair(h, (uint32_t)i));
+    }
+    // Equal hashes sort together with the lowest index first
+    std::sort(keys.begin(), keys.end());
+    uint16_t dups = 0;
+    for (size_t i = 0; i < keys.size();) {
+        size_t end = i + 1;
+        while (end < keys.size() && keys[end].first == keys[i].first) {
+            end++;
+        }
+        for (size_t j = i + 1; j < end; j++) {
+            uint16_t dup = keys[j].second;
+            for (size_t k = i; k < j; k++) {
+                uint16_t first = keys[k].second;
+                if (map[first] != first || pattern[first]->numRows != pattern[dup]->numRows) {
+                    continue;
+                }
+                size_t cells = (size_t)pattern[dup]->numRows * header.numChannels;
+                if (same_cells(pattern_cells(first, scratch[0]), pattern_cells(dup, scratch[1]), cells)) {
+                    map[dup] = first;
+                    dups++;
+                    XM_LOGI("Pattern #%d duplicates #%d\n", dup, first);
+                    break;
+                }
+            }
+        }
+        i = end;
+    }
+    return dups;
+}
+
+static bool same_sample(const xm_sample_t &a, const xm_sample_t &b) {
+    if (a.loopStart != b.loopStart || a.loopLength != b.loopLength || a.volume != b.volume || a.finetune != b.finetune ||
+        a.type.loop_mode != b.type.loop_mode || a.type.sample_bit != b.type.sample_bit || a.panning != b.panning ||
+        a.relNoteNum != b.relNoteNum || xm_sample_length(&a) != xm_sample_length(&b)) {
+        return false;
+    }
+    if (xm_sample_is_packed(&a) || xm_sample_is_packed(&b)) {
+        return a.adpcm == b.adpcm;
+    }
+    if (a.type.sample_bit) {
+        return a.data.data() == b.data.data() || memcmp(a.data.data(), b.data.data(), a.data.size() * 2) == 0;
+    }
+    return a.data8.data() == b.data8.data() || memcmp(a.data8.data(), b.data8.data(), a.data8.size()) == 0;
+}
+
+static bool same_instrument(const xm_instrument_t &a, const xm_instrument_t &b) {
+    if (a.type != b.type || a.sample.size() != b.sample.size()) {
+        return false;
+    }
+    if (a.sample.empty()) {
+        return true;
+    }
+    // Keymap, envelopes, vibrato and fadeout: the 234-byte block without its reserved tail
+    if (memcmp(&a.sampleHeaderSize, &b.sampleHeaderSize, 234 - sizeof(a.reserved)) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < a.sample.size(); i++) {
+        if (!same_sample(a.sample[i], b.sample[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint16_t XMFile::find_duplicate_instruments(std::vector<uint16_t> &map) const {
+    if (probed) {
+        return identity_map(map, instrument.size());
+    }
+    uint16_t dups = 0;
+    map.resize(instrument.size());
+    for (size_t i = 0; i < instrument.size(); i++) {
+        map[i] = i;
+        for (size_t j = 0; j < i; j++) {
+            if (map[j] == j && same_instrument(instrument[j], instrument[i])) {
+                map[i] = j;
+                dups++;
+                XM_LOGI("Instrument #%zu duplicates #%zu\n", i + 1, j + 1);
+                break;
+            }
+        }
+    }
+    return dups;
+}
+
+uint16_t XMFile::merge_duplicate_instruments() {
+    if (probed) {
+        return 0; // the patterns can't be renumbered
+    }
+    std::vector<uint16_t> map;
+    uint16_t dups = find_duplicate_instruments(map);
+    if (dups == 0) {
+        return 0;
+    }
+    // 1-based numbers as used in the patterns, duplicates take their first copy's number
+    std::vector<uint8_t> renum(instrument.size() + 1, 0);
+    size_t kept = 0;
+    for (size_t i = 0; i < instrument.size(); i++) {
+        if (map[i] == i) {
+            renum[i + 1] = ++kept;
+            if (kept - 1 != i) {
+                instrument[kept - 1] = std::move(instrument[i]);
+            }
+        } else {
+            renum[i + 1] = renum[map[i] + 1];
+        }
     }
+    // Only patterns whose numbers change are taken for writing, the rest stay clean for
+    // XM_LOAD_KEEP_SOURCE saves and shared with clones
+    for (uint16_t p = 0; p < pattern.size(); p++) {
+        xm_pattern_cview_t view = peek_pattern_view(p);
+        size_t cells = (size_t)view.rows * view.channels;
+        size_t c = 0;
+        while (view.cells && c < cells && (view.cells[c].inst >= renum.size() || renum[view.cells[c].inst] == view.cells[c].inst)) {
+            c++;
+        }
+        xm_pattern_t *pat = c < cells ? get_pattern(p) : NULL;
+        for (; pat && c < cells; c++) {
+            uint8_t inst = pat->unpk_pattern[c].inst;
+            if (inst && inst < renum.size()) {
+                pat->unpk_pattern[c].inst = renum[inst];
+            }
+        }
+    }
+    instrument.resize(kept);
+    header.numInstruments = kept;
+    XM_LOGI("Merged %d duplicate instruments\n", dups);
+    return dups;
 }
 
 void XMFile::print_pattern(uint16_t num, int startChl, int endChl, int startRow, int endRow) {
+    if (peek_pattern_view(num).cells == NULL) {
+        return;
+    }
     printf("PATTERN #%d: Channel %d ~ %d, Row %d ~ %d\n", num, startChl, endChl - 1, startRow, endRow - 1);
     printf("┌────");
     for (int i = startChl; i < endChl; i++) {
@@ -243,7 +1136,7 @@ void XMFile::print_pattern(uint16_t num, int startChl, int endChl, int startRow,
     for (int r = startRow; r < endRow; r++) {
         printf("│ %02X ", r);
         for (int c = startChl; c < endChl; c++) {
-            xm_unit_t tmp = pattern[num].unpk_pattern[c][r];
+            xm_unit_t tmp = pattern[num]->unpk_pattern[r * header.numChannels + c];
             printf("│0x%02X│", tmp.mask);
             if (HAS_NOTE(tmp.mask)) {
                 char note_tmp[4];
@@ -293,215 +1186,1163 @@ void XMFile::print_pattern(uint16_t num, int startChl, int endChl, int startRow,
     printf("┘\n");
 }
 
-void XMFile::read_instrument() {
-    printf("Reading instrument...\n");
+int XMFile::read_instrument() {
+    XM_LOGI("Reading instrument...\n");
+    size_t cap = instrument.capacity();
     instrument.resize(header.numInstruments);
+    stats.load_allocs += grew(instrument, cap);
     for (int i = 0; i < header.numInstruments; i++) {
-        printf("Instrument #%d\n", i);
-        fread(&instrument[i], 1, 29, xm_file);
+        XM_LOGD("Instrument #%d\n", i);
+        size_t start_pos = src_pos;
+        if (read_bytes(&instrument[i], 29)) {
+            return FILE_READ_ERROR;
+        }
         // sizeof(xm_instrument_t);
-        printf("Size: %d\n", instrument[i].size);
-        printf("Name: %.22s\n", instrument[i].name);
-        printf("Type: %d\n", instrument[i].type);
+        XM_LOGD("Size: %d\n", instrument[i].size);
+        XM_LOGD("Name: %.22s\n", instrument[i].name);
+        XM_LOGD("Type: %d\n", instrument[i].type);
         if (instrument[i].numSamples == 0) {
-            printf("No Sample, Skip!\n");
+            XM_LOGD("No Sample, Skip!\n");
+            instrument[i].sample.clear(); // may be left over from a previous module
+            instrument[i].volEnvTable.clear();
+            instrument[i].panEnvTable.clear();
+            if (instrument[i].size > 29 && instrument[i].size <= src_size - start_pos) {
+                src_pos = start_pos + instrument[i].size;
+            }
             continue;
         }
-        printf("Number of samples: %d\n", instrument[i].numSamples);
-        fread(&instrument[i].sampleHeaderSize, 1, 234, xm_file);
-        printf("Sample header size: %d\n", instrument[i].sampleHeaderSize);
-        printf("Sample Keymap:\n");
-        for (int n = 0; n < 96; n++) {
-            printf("%d ", instrument[i].sampleKeymap[n]);
+        XM_LOGD("Number of samples: %d\n", instrument[i].numSamples);
+        if (read_bytes(&instrument[i].sampleHeaderSize, 234)) {
+            return FILE_READ_ERROR;
         }
-        printf("\n");
-        printf("Envelope:\n");
-        printf("Volume (%s):\n", instrument[i].volType.on ? "ON" : "OFF");
-        instrument[i].volEnvTable.clear();
-        if (instrument[i].numVolPoint) {
-            genEnvTable(instrument[i].volEnv, instrument[i].numVolPoint, instrument[i].volEnvTable);
-            printf("XXXX -> YYYY\n");
-            for (int n = 0; n < instrument[i].numVolPoint; n++) {
-                printf("%4d -> %4d ", instrument[i].volEnv[n].x, instrument[i].volEnv[n].y);
-                if (instrument[i].volType.loop) {
-                    if (n == instrument[i].volLoopStart) {
-                        printf("<-LOOPSTART ");
-                    }
-                    if (n == instrument[i].volLoopStart) {
-                        printf("<-LOOPEND ");
-                    }
-                }
-                if (instrument[i].volType.sus) {
-                    if (n == instrument[i].volSusPoint) {
-                        printf("<-SUSTIAN");
-                    }
-                }
-                printf("\n");
+        XM_LOGD("Sample header size: %d\n", instrument[i].sampleHeaderSize);
+        if (log_enabled(XM_LOG_DEBUG)) {
+            XM_LOGD("Sample Keymap:\n");
+            for (int n = 0; n < 96; n++) {
+                XM_LOGD("%d ", instrument[i].sampleKeymap[n]);
             }
-            printf("LUT:\n");
-            for (int x = 0; x < instrument[i].volEnvTable.size(); x++) {
-                printf("%d ", instrument[i].volEnvTable[x]);
-            }
-            printf("\n");
+            XM_LOGD("\n");
+            XM_LOGD("Envelope:\n");
         }
-        printf("Panning (%s):\n", instrument[i].panType.on ? "ON" : "OFF");
+        size_t vol_cap = instrument[i].volEnvTable.capacity();
+        size_t pan_cap = instrument[i].panEnvTable.capacity();
+        instrument[i].volEnvTable.clear();
         instrument[i].panEnvTable.clear();
-        if (instrument[i].numPanPoint) {
-            genEnvTable(instrument[i].panEnv, instrument[i].numPanPoint, instrument[i].panEnvTable);
-            printf("XXXX -> YYYY\n");
-            for (int n = 0; n < instrument[i].numVolPoint; n++) {
-                printf("%4d -> %4d ", instrument[i].panEnv[n].x, instrument[i].panEnv[n].y);
-                if (instrument[i].panType.loop) {
-                    if (n == instrument[i].panLoopStart) {
-                        printf("<-LOOPSTART ");
-                    }
-                    if (n == instrument[i].panLoopStart) {
-                        printf("<-LOOPEND ");
-                    }
-                }
-                if (instrument[i].panType.sus) {
-                    if (n == instrument[i].panSusPoint) {
-                        printf("<-SUSTIAN");
-                    }
-                }
-                printf("\n");
+        if (load_flags & XM_LOAD_ENV_TABLES) {
+            if (instrument[i].numVolPoint) {
+                genEnvTable(instrument[i].volEnv, instrument[i].numVolPoint, instrument[i].volEnvTable);
             }
-            printf("LUT:\n");
-            for (int x = 0; x < instrument[i].panEnvTable.size(); x++) {
-                printf("%d ", instrument[i].panEnvTable[x]);
+            if (instrument[i].numPanPoint) {
+                genEnvTable(instrument[i].panEnv, instrument[i].numPanPoint, instrument[i].panEnvTable);
             }
-            printf("\n");
         }
-        printf("Vibrato type: %d\n", instrument[i].vibratoType);
-        printf("Vibrato sweep: %d\n", instrument[i].vibratoSweep);
-        printf("Vibrato depth: %d\n", instrument[i].vibratoDepth);
-        printf("Vibrato rate: %d\n", instrument[i].vibratoRate);
-        printf("Volume fadeout: %d\n", instrument[i].volFadeout);
-        printf("%s\n", instrument[i].reserved);
-        fseek(xm_file, instrument[i].size - 263, SEEK_CUR);
-        read_samples(&instrument[i]);
-        printf("\n");
+        stats.load_allocs += grew(instrument[i].volEnvTable, vol_cap) + grew(instrument[i].panEnvTable, pan_cap);
+        if (log_enabled(XM_LOG_DEBUG)) {
+            dump_envelope("Volume", instrument[i].volEnv, instrument[i].numVolPoint, instrument[i].volType,
+                          instrument[i].volSusPoint, instrument[i].volLoopStart, instrument[i].volLoopEnd, instrument[i].volEnvTable);
+            dump_envelope("Panning", instrument[i].panEnv, instrument[i].numPanPoint, instrument[i].panType,
+                          instrument[i].panSusPoint, instrument[i].panLoopStart, instrument[i].panLoopEnd, instrument[i].panEnvTable);
+        }
+        XM_LOGD("Vibrato type: %d\n", instrument[i].vibratoType);
+        XM_LOGD("Vibrato sweep: %d\n", instrument[i].vibratoSweep);
+        XM_LOGD("Vibrato depth: %d\n", instrument[i].vibratoDepth);
+        XM_LOGD("Vibrato rate: %d\n", instrument[i].vibratoRate);
+        XM_LOGD("Volume fadeout: %d\n", instrument[i].volFadeout);
+        XM_LOGD("%.22s\n", instrument[i].reserved);
+        if (instrument[i].size > src_size - start_pos) {
+            return FILE_READ_ERROR;
+        }
+        src_pos = start_pos + instrument[i].size;
+        if (read_samples(&instrument[i])) {
+            return FILE_READ_ERROR;
+        }
+        XM_LOGD("\n");
     }
+    return 0;
 }
 
 void XMFile::write_instrument() {
-    printf("Writing instrument...\n");
+    XM_LOGI("Writing instrument...\n");
     header.numInstruments = instrument.size();
-    size_t total_size = 0;
     for (int i = 0; i < header.numInstruments; i++) {
-        size_t total_size = 0;
-        size_t start_addr = ftell(xm_file);
-        printf("Writing instrument #%d...\n", i);
-        fwrite(&instrument[i], 1, 29, xm_file);
-        total_size += 29;
+        XM_LOGD("Writing instrument #%d...\n", i);
+        instrument[i].numSamples = instrument[i].sample.size();
+        instrument[i].size = instrument[i].numSamples ? 29 + 234 : 29;
+        write_bytes(&instrument[i], 29);
         // sizeof(xm_instrument_t);
         if (instrument[i].numSamples == 0) {
-            printf("No Sample, Skip!\n");
+            XM_LOGD("No Sample, Skip!\n");
             continue;
         }
-        printf("Number of samples: %d\n", instrument[i].numSamples);
-        fwrite(&instrument[i].sampleHeaderSize, 1, 234, xm_file);
-        total_size += 234;
-        size_t end_addr = ftell(xm_file);
-        fseek(xm_file, start_addr, SEEK_SET);
-        instrument[i].size = total_size;
-        fwrite(&instrument[i].size, 4, 1, xm_file);
-        fseek(xm_file, end_addr, SEEK_SET);
+        XM_LOGD("Number of samples: %d\n", instrument[i].numSamples);
+        write_bytes(&instrument[i].sampleHeaderSize, 234);
         write_samples(&instrument[i]);
     }
 }
 
 void XMFile::write_samples(xm_instrument_t *inst) {
-    printf("Writing samples...\n");
+    XM_LOGI("Writing samples...\n");
     inst->numSamples = inst->sample.size();
     for (int i = 0; i < inst->numSamples; i++) {
-        printf("Writing sample#%d header\n", i);
+        XM_LOGD("Writing sample#%d header\n", i);
         xm_sample_t *smp = &inst->sample[i];
-        smp->length = smp->data.size();
-        smp->type.sample_bit = 1;
-        smp->sampleType = 0;
-        uint32_t writeLength = smp->length * 2;
-        uint32_t writeLoopStart = smp->loopStart * 2;
-        uint32_t writeLoopLength = smp->loopLength * 2;
-        fwrite(&writeLength, 4, 1, xm_file);
-        fwrite(&writeLoopStart, 4, 1, xm_file);
-        fwrite(&writeLoopLength, 4, 1, xm_file);
-        fwrite(&smp->volume, 1, 28, xm_file);
+        smp->length = xm_sample_length(smp);
+        smp->sampleType = (!smp->type.sample_bit && (save_flags & XM_SAVE_ADPCM)) ? 0xAD : 0;
+        // Lengths are stored in bytes, samples are written at their native width
+        uint32_t bytes_per_sample = smp->type.sample_bit ? 2 : 1;
+        uint32_t writeLength = smp->length * bytes_per_sample;
+        uint32_t writeLoopStart = smp->loopStart * bytes_per_sample;
+        uint32_t writeLoopLength = smp->loopLength * bytes_per_sample;
+        write_bytes(&writeLength, 4);
+        write_bytes(&writeLoopStart, 4);
+        write_bytes(&writeLoopLength, 4);
+        write_bytes(&smp->volume, 28);
     }
     for (int i = 0; i < inst->numSamples; i++) {
-        printf("Writing sample#%d data\n", i);
+        XM_LOGD("Writing sample#%d data\n", i);
         xm_sample_t *smp = &inst->sample[i];
-        std::vector<int16_t> dpcm_write_buf(smp->length);
-        printf("Encodeing...\n");
-        encode_dpcm_16bit(smp->data.data(), dpcm_write_buf.data(), smp->length);
-        printf("Writing...(%d Bytes)\n", smp->length * 2);
-        fwrite(dpcm_write_buf.data(), 2, smp->length, xm_file);
+        size_t file_bytes = smp->type.sample_bit ? (size_t)smp->length * 2 :
+                            (smp->sampleType == 0xAD ? 16 + (smp->length + 1) / 2 : smp->length);
+        if (!smp->dirty && orig_data && smp->fileType == smp->sampleType && smp->fileSize == file_bytes) {
+            write_source(smp->fileOffset, smp->fileSize); // unedited and encoded the same way
+            continue;
+        }
+        XM_LOGD("Encodeing...\n");
+        uint64_t t0 = now_ns();
+        size_t cap = enc_buf.capacity();
+        const std::vector<uint8_t> *out = &enc_buf;
+        if (smp->type.sample_bit) {
+            enc_buf.resize(smp->length * 2);
+            encode_dpcm_16bit(smp->data.data(), (int16_t *)enc_buf.data(), smp->length);
+        } else if (smp->sampleType == 0xAD && xm_sample_is_packed(smp)) {
+            out = &smp->adpcm; // already in the file's format
+        } else if (smp->sampleType == 0xAD) {
+            enc_buf.resize(16 + (smp->length + 1) / 2);
+            encode_adpcm_4bit(smp->data8.data(), smp->length, (int8_t *)enc_buf.data(), enc_buf.data() + 16);
+        } else if (xm_sample_is_packed(smp)) {
+            // PCM goes to the upper half, DPCM to the lower one
+            enc_buf.resize(smp->length * 2);
+            xm_sample_decode(smp, 0, (int8_t *)enc_buf.data() + smp->length, smp->length);
+            encode_dpcm_8bit((const int8_t *)enc_buf.data() + smp->length, (int8_t *)enc_buf.data(), smp->length);
+            enc_buf.resize(smp->length);
+        } else {
+            enc_buf.resize(smp->length);
+            encode_dpcm_8bit(smp->data8.data(), (int8_t *)enc_buf.data(), smp->length);
+        }
+        stats.save_allocs += grew(enc_buf, cap);
+        stats.encode_ns += now_ns() - t0;
+        XM_LOGD("Writing...(%zu Bytes)\n", out->size());
+        write_bytes(out->data(), out->size());
     }
 }
 
-void XMFile::read_samples(xm_instrument_t *inst) {
-    printf("Reading samples header...\n");
+int XMFile::read_samples(xm_instrument_t *inst) {
+    XM_LOGI("Reading samples header...\n");
+    size_t cap = inst->sample.capacity();
     inst->sample.resize(inst->numSamples);
+    stats.load_allocs += grew(inst->sample, cap);
     for (int i = 0; i < inst->numSamples; i++) {
         xm_sample_t *smp = &inst->sample[i];
-        fread(smp, 1, 40, xm_file);
+        if (read_bytes(smp, 40)) {
+            return FILE_READ_ERROR;
+        }
         if (smp->type.sample_bit) { // 16-bit
             smp->length /= 2;
             smp->loopStart /= 2;
             smp->loopLength /= 2;
         }
-        printf("Sample #%d: %.22s\n", i, smp->name);
-        printf("Length: %d Samples\n", smp->length);
-        printf("Type: %s\n", (smp->sampleType == 0xAD) ? "4-bit ADPCM" : "Regular DPCM");
-        printf("Width: %s\n", smp->type.sample_bit ? "16-bit" : "8-bit");
-        printf("Loop: %s\n", !smp->type.loop_mode ? "No Loop" : (smp->type.loop_mode == 2 ? "Ping-Pong" : "Forward"));
-        printf("Loop start: %d\n", smp->loopStart);
-        printf("Loop length: %d\n", smp->loopLength);
-        printf("Relative note number: %d\n", smp->relNoteNum);
-        printf("Panning: %d\n", smp->panning);
-    }
-    printf("Reading samples data...\n");
+        XM_LOGD("Sample #%d: %.22s\n", i, smp->name);
+        XM_LOGD("Length: %d Samples\n", smp->length);
+        XM_LOGD("Type: %s\n", (smp->sampleType == 0xAD) ? "4-bit ADPCM" : "Regular DPCM");
+        XM_LOGD("Width: %s\n", smp->type.sample_bit ? "16-bit" : "8-bit");
+        XM_LOGD("Loop: %s\n", !smp->type.loop_mode ? "No Loop" : (smp->type.loop_mode == 2 ? "Ping-Pong" : "Forward"));
+        XM_LOGD("Loop start: %d\n", smp->loopStart);
+        XM_LOGD("Loop length: %d\n", smp->loopLength);
+        XM_LOGD("Relative note number: %d\n", smp->relNoteNum);
+        XM_LOGD("Panning: %d\n", smp->panning);
+    }
+    XM_LOGI("Reading samples data...\n");
     for (int i = 0; i < inst->numSamples; i++) {
         xm_sample_t *smp = &inst->sample[i];
-        if (smp->type.sample_bit) { // 16-bit sample
-            printf("#%d Reading... (16bit)\n", i);
-            std::vector<int16_t> unpack_buf(smp->length);
-            fread(unpack_buf.data(), 2, smp->length, xm_file);
-            printf("#%d Unpacking...\n", i);
-            smp->data.resize(smp->length);
-            decode_dpcm_16bit(unpack_buf.data(), smp->data.data(), smp->data.size());
-        } else { // 8-bit sample
-            printf("#%d Reading... (8bit)\n", i);
-            std::vector<int8_t> unpack_buf(smp->length);
-            std::vector<int8_t> unpack_out_buf(smp->length);
-            fread(unpack_buf.data(), 1, smp->length, xm_file);
-            printf("#%d Unpacking...\n", i);
-            smp->data.resize(smp->length);
-            decode_dpcm_8bit(unpack_buf.data(), unpack_out_buf.data(), smp->length);
-            for (int x = 0; x < smp->length; x++) {
-                smp->data[x] = unpack_out_buf[x] << 8;
+        size_t bytes_per_sample = smp->type.sample_bit ? 2 : 1;
+        if (smp->sampleType == 0xAD && smp->type.sample_bit) {
+            smp->sampleType = 0; // ModPlug only packs 8-bit samples, read it as DPCM
+        }
+        if (load_flags & XM_LOAD_PROBE) { // smp->length is all there is, the data is skipped
+            size_t bytes = smp->sampleType == 0xAD ? 16 + (smp->length + 1) / 2 : smp->length * bytes_per_sample;
+            src_pos += bytes < src_size - src_pos ? bytes : src_size - src_pos;
+            smp->data.release();
+            smp->data8.release();
+            smp->adpcm.clear();
+            smp->adpcm_keys.clear();
+            smp->play = NULL;
+            smp->shared = false;
+            smp->hold.reset();
+            continue;
+        }
+        smp->fileOffset = src_pos;
+        smp->fileType = smp->sampleType == 0xAD ? 0xAD : 0; // any other value is plain DPCM
+        smp->dirty = !(load_flags & XM_LOAD_KEEP_SOURCE);
+        if (smp->sampleType == 0xAD) {
+            // Delta table, then two samples per byte; job.size is in bytes here
+            size_t bytes = 16 + (smp->length + 1) / 2;
+            size_t avail = src_size - src_pos;
+            size_t count = bytes < avail ? bytes : avail;
+            if (count < bytes) { // the arena is sized from the length, a bogus one mustn't allocate gigabytes
+                XM_LOGI("Sample #%d truncated: %u of %u samples\n", i, (uint32_t)(count > 16 ? (count - 16) * 2 : 0), smp->length);
+                smp->length = count > 16 ? (count - 16) * 2 : 0;
             }
+            smp->fileSize = count;
+            xm_load_job_t job = {read_ptr(count), count, NULL, smp};
+            add_load_job(job);
+            continue;
+        }
+        // Truncated sample data (common at the end of a file) is cut to what's there, the
+        // arena is sized from the length
+        size_t avail = (src_size - src_pos) / bytes_per_sample;
+        size_t count = smp->length < avail ? smp->length : avail;
+        if (count < smp->length) {
+            XM_LOGI("Sample #%d truncated: %zu of %u samples\n", i, count, smp->length);
+            smp->length = count;
+        }
+        const uint8_t *dpcm = read_ptr(count * bytes_per_sample);
+        smp->fileSize = count * bytes_per_sample; // short of the length when truncated, never reused then
+        XM_LOGD("#%d Reading... (%s)\n", i, smp->type.sample_bit ? "16bit" : "8bit");
+        XM_LOGD("#%d Unpacking...\n", i);
+        xm_load_job_t job = {dpcm, count, NULL, smp};
+        add_load_job(job);
+    }
+    return 0;
+}
+
+// Bytes a job reads or writes, parallel passes start with the largest
+static size_t load_job_cost(const xm_load_job_t &job) {
+    return job.pat ? job.size : job.size * (job.smp->type.sample_bit ? 2 : 1);
+}
+
+// Loop the way it plays: 0 = none, 1 = forward, 2 = ping-pong, le clipped to the data
+static int sample_loop(const xm_sample_t *smp, uint32_t *ls, uint32_t *le) {
+    int mode = smp->type.loop_mode;
+    if (mode == 0 || mode == 3 || smp->loopLength == 0 || smp->loopStart >= smp->length) {
+        *ls = *le = smp->length;
+        return 0;
+    }
+    *ls = smp->loopStart;
+    *le = smp->loopLength < smp->length - smp->loopStart ? smp->loopStart + smp->loopLength : smp->length;
+    return mode;
+}
+
+static size_t align16(size_t n) {
+    return (n + 15) & ~(size_t)15; // keeps every span aligned for the SIMD decoders
+}
+
+// Arena bytes of a sample. Padded samples get 16 bytes of guard before the data and their
+// unrolled loop plus guard after it. If data follows the loop end the playback copy goes
+// after the sample instead, at *play_offset from the start of its slice.
+static size_t sample_arena_bytes(const xm_sample_t *smp, uint32_t load_flags, size_t *play_offset = NULL) {
+    if (smp->sampleType == 0xAD && (load_flags & XM_LOAD_KEEP_ADPCM)) {
+        return 0;
+    }
+    size_t width = smp->type.sample_bit ? 2 : 1;
+    size_t bytes = (size_t)smp->length * width;
+    if (!(load_flags & XM_LOAD_PAD_LOOPS)) {
+        return align16(bytes);
+    }
+    uint32_t ls, le;
+    int mode = sample_loop(smp, &ls, &le);
+    size_t tail = (mode == 2 ? le - ls : 0) + XM_PAD_GUARD;
+    size_t offset = 16;
+    if (mode && le < smp->length) {
+        offset = align16(16 + bytes) + 16;
+        bytes = (size_t)le * width;
+    }
+    if (play_offset) {
+        *play_offset = offset;
+    }
+    return align16(offset + bytes + tail * width);
+}
+
+template <typename T>
+static void pad_sample(const xm_sample_t *smp, const T *pcm) {
+    T *play = (T *)smp->play;
+    uint32_t ls, le;
+    int mode = sample_loop(smp, &ls, &le);
+    uint32_t end = mode ? le : smp->length;
+    if (play != pcm) {
+        memcpy(play, pcm, end * sizeof(T));
+    }
+    for (int i = 1; i <= XM_PAD_GUARD; i++) {
+        play[-i] = end ? play[0] : 0;
+    }
+    if (mode == 2) {
+        // Mirrors the checked mixer: the last loop sample is held across the turn
+        for (uint32_t i = 0; i < le - ls; i++) {
+            play[le + i] = play[i ? le - i : le - 1];
         }
+        end += le - ls;
     }
+    for (uint32_t i = 0; i < XM_PAD_GUARD; i++) {
+        play[end + i] = mode ? play[ls + i % (end - ls)] : end ? play[end - 1] : 0;
+    }
+}
+
+static uint64_t hash_bytes(const uint8_t *p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+// Pattern unpack or sample decode, each job only touches its own pattern/sample.
+// Returns the number of buffers that had to be allocated.
+uint32_t XMFile::run_load_job(xm_load_job_t &job) {
+    if (job.pat) {
+        size_t cap = job.pat->unpk_pattern.capacity();
+        job.failed = unpack_xm_pattern(job.src, job.size, job.pat->unpk_pattern, job.pat->numRows, header.numChannels,
+                                       job.readable) != 0;
+        return grew(job.pat->unpk_pattern, cap);
+    }
+    // PCM spans were bound to the sample arena by bind_sample_arena(), only the
+    // decoded count is written, a truncated tail is zeroed
+    xm_sample_t *smp = job.smp;
+    if (smp->sampleType == 0xAD && (load_flags & XM_LOAD_KEEP_ADPCM)) {
+        size_t cap = smp->adpcm.capacity(), key_cap = smp->adpcm_keys.capacity();
+        smp->adpcm.assign(16 + (smp->length + 1) / 2, 0);
+        if (job.size) {
+            memcpy(smp->adpcm.data(), job.src, job.size); // a truncated tail stays zero (silence)
+        }
+        adpcm_build_keys(smp);
+        return grew(smp->adpcm, cap) + grew(smp->adpcm_keys, key_cap);
+    }
+    smp->adpcm.clear();
+    smp->adpcm_keys.clear();
+    if (smp->sampleType == 0xAD) { // 4-bit ADPCM to 8-bit PCM
+        size_t count = job.size > 16 ? (job.size - 16) * 2 : 0;
+        count = count < smp->length ? count : smp->length;
+        if (count) {
+            decode_adpcm_4bit(job.src + 16, (const int8_t *)job.src, 0, 0, smp->data8.data(), count);
+        }
+        memset(smp->data8.data() + count, 0, smp->length - count);
+    } else if (smp->type.sample_bit) { // 16-bit sample
+        decode_dpcm_16bit_le(job.src, smp->data.data(), job.size);
+        memset(smp->data.data() + job.size, 0, (smp->length - job.size) * sizeof(int16_t));
+    } else { // 8-bit sample, kept at 8 bits
+        decode_dpcm_8bit((const int8_t *)job.src, smp->data8.data(), job.size);
+        memset(smp->data8.data() + job.size, 0, smp->length - job.size);
+    }
+    if (smp->play && smp->type.sample_bit) {
+        pad_sample(smp, smp->data.data());
+    } else if (smp->play) {
+        pad_sample(smp, smp->data8.data());
+    }
+    return 0;
+}
+
+// Samples are always queued so the arena can be sized first. Patterns are unpacked
+// in place on serial loads and queued for the decode pass on parallel ones.
+void XMFile::add_load_job(const xm_load_job_t &job) {
+    if (job.smp || load_threads > 1) {
+        size_t cap = load_jobs.capacity();
+        load_jobs.push_back(job);
+        stats.load_allocs += grew(load_jobs, cap);
+        return;
+    }
+    xm_load_job_t now = job;
+    stats.load_allocs += run_load_job(now);
+    load_error |= now.failed;
+}
+
+// Padded samples also share their playback copy, so their loops have to match too
+static bool same_sample_source(const xm_load_job_t &a, const xm_load_job_t &b, uint32_t load_flags) {
+    if ((load_flags & XM_LOAD_PAD_LOOPS) && (a.smp->type.loop_mode != b.smp->type.loop_mode ||
+        a.smp->loopStart != b.smp->loopStart || a.smp->loopLength != b.smp->loopLength)) {
+        return false;
+    }
+    return a.size == b.size && a.smp->length == b.smp->length && a.smp->type.sample_bit == b.smp->type.sample_bit &&
+           a.smp->sampleType == b.smp->sampleType && memcmp(a.src, b.src, load_job_cost(a)) == 0;
+}
+
+// Identical encoded bytes decode to identical PCM, so duplicates are found before decoding:
+// their jobs are dropped and bind_sample_arena() points them at the first copy's PCM
+void XMFile::dedup_sample_jobs() {
+    dedup_keys.clear();
+    for (size_t i = 0; i < load_jobs.size(); i++) {
+        const xm_load_job_t &job = load_jobs[i];
+        if (job.smp && job.size && sample_arena_bytes(job.smp, load_flags)) {
+            uint64_t h = hash_bytes(job.src, load_job_cost(job));
+            h ^= ((uint64_t)job.smp->length << 9 | job.smp->sampleType << 1 | job.smp->type.sample_bit) * 0x9E3779B97F4A7C15ull;
+            dedup_keys.push_back(std::make_pair(h, (uint32_t)i));
+        }
+    }
+    std::sort(dedup_keys.begin(), dedup_keys.end());
+    for (size_t i = 0; i < dedup_keys.size();) {
+        size_t end = i + 1;
+        while (end < dedup_keys.size() && dedup_keys[end].first == dedup_keys[i].first) {
+            end++;
+        }
+        // Within a run of equal hashes every job is checked against the earlier unique ones
+        for (size_t j = i + 1; j < end; j++) {
+            xm_load_job_t &dup = load_jobs[dedup_keys[j].second];
+            for (size_t k = i; k < j; k++) {
+                const xm_load_job_t &first = load_jobs[dedup_keys[k].second];
+                if (first.smp && same_sample_source(first, dup, load_flags)) {
+                    dedup_links.push_back(std::make_pair(dup.smp, first.smp));
+                    stats.dedup_samples++;
+                    stats.dedup_bytes += (size_t)dup.smp->length * (dup.smp->type.sample_bit ? 2 : 1);
+                    dup.smp = NULL;
+                    break;
+                }
+            }
+        }
+        i = end;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < load_jobs.size(); i++) {
+        if (load_jobs[i].smp || load_jobs[i].pat) {
+            load_jobs[n++] = load_jobs[i];
+        }
+    }
+    load_jobs.resize(n);
+}
+
+// All decoded PCM of the module goes into one block, sized from the sample headers before
+// anything is decoded. With XM_LOAD_KEEP_BUFFERS a large enough block is reused.
+int XMFile::bind_sample_arena() {
+    cache_map.reset(); // every sample is rebound below
+    dedup_links.clear();
+    if (load_flags & XM_LOAD_DEDUP_SAMPLES) {
+        dedup_sample_jobs();
+    }
+    size_t need = 0;
+    for (size_t i = 0; i < load_jobs.size(); i++) {
+        if (load_jobs[i].smp) {
+            need += sample_arena_bytes(load_jobs[i].smp, load_flags);
+        }
+    }
+    // A clone still playing the old PCM keeps its block, this module gets a new one
+    if (need > sample_arena_size || sample_arena.use_count() > 1 ||
+        (need < sample_arena_size && !(load_flags & XM_LOAD_KEEP_BUFFERS))) {
+        sample_arena.reset();
+        sample_arena_size = 0;
+        void *block = malloc(need ? need : 1);
+        if (block == NULL) {
+            return FILE_READ_ERROR;
+        }
+        sample_arena.reset(block, free);
+        sample_arena_size = need;
+        stats.load_allocs++;
+    }
+    uint8_t *arena = (uint8_t *)sample_arena.get();
+    size_t offset = 0;
+    for (size_t i = 0; i < load_jobs.size(); i++) {
+        xm_sample_t *smp = load_jobs[i].smp;
+        if (smp == NULL) {
+            continue;
+        }
+        size_t play_offset = 0;
+        size_t bytes = sample_arena_bytes(smp, load_flags, &play_offset);
+        size_t data_offset = offset + (play_offset ? 16 : 0);
+        smp->shared = false;
+        smp->hold.reset();
+        smp->play = NULL;
+        if (bytes == 0) {
+            smp->data.release();
+            smp->data8.release();
+        } else if (smp->type.sample_bit) {
+            smp->data8.release();
+            smp->data.bind((int16_t *)(arena + data_offset), smp->length);
+        } else {
+            smp->data.release();
+            smp->data8.bind((int8_t *)(arena + data_offset), smp->length);
+        }
+        if (bytes && play_offset) { // filled by pad_sample() after decoding
+            uint32_t ls, le;
+            int mode = sample_loop(smp, &ls, &le);
+            smp->play = arena + offset + play_offset;
+            smp->play_loop_start = mode ? ls : le;
+            smp->play_loop_end = mode == 2 ? le + (le - ls) : le;
+        }
+        offset += bytes;
+    }
+    for (size_t i = 0; i < dedup_links.size(); i++) {
+        xm_sample_t *dup = dedup_links[i].first, *first = dedup_links[i].second;
+        dup->data = first->data; // arena spans, the copy shares the memory
+        dup->data8 = first->data8;
+        dup->play = first->play;
+        dup->play_loop_start = first->play_loop_start;
+        dup->play_loop_end = first->play_loop_end;
+        dup->adpcm.clear();
+        dup->adpcm_keys.clear();
+        dup->shared = first->shared = true;
+    }
+    return 0;
+}
+
+// Largest jobs first, idle threads pull the next one from a shared counter.
+// A serial pass keeps file order.
+void XMFile::run_load_jobs() {
+    uint64_t start = now_ns();
+    if (load_threads > 1) {
+        std::sort(load_jobs.begin(), load_jobs.end(), [](const xm_load_job_t &a, const xm_load_job_t &b) {
+            return load_job_cost(a) > load_job_cost(b);
+        });
+    }
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> decode_ns(0);
+    std::atomic<uint32_t> allocs(0);
+    auto worker = [this, &next, &decode_ns, &allocs]() {
+        uint64_t my_ns = 0;
+        uint32_t my_allocs = 0;
+        for (size_t i = next++; i < load_jobs.size(); i = next++) {
+            uint64_t t0 = now_ns();
+            my_allocs += run_load_job(load_jobs[i]);
+            if (load_jobs[i].smp) {
+                my_ns += now_ns() - t0;
+            }
+        }
+        decode_ns += my_ns;
+        allocs += my_allocs;
+    };
+    size_t num_threads = load_threads < load_jobs.size() ? load_threads : load_jobs.size();
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    for (size_t i = 0; i < load_jobs.size(); i++) {
+        load_error |= load_jobs[i].failed;
+    }
+    load_jobs.clear();
+    stats.sample_decode_ns += decode_ns;
+    stats.load_allocs += allocs;
+    stats.parallel_ns = now_ns() - start;
 }
 
 int XMFile::read_all() {
-    if (read_header()) {
+    load_jobs.clear();
+    load_error = false;
+    probed = (load_flags & XM_LOAD_PROBE) != 0;
+    uint64_t t0 = now_ns();
+    int ret = read_header();
+    uint64_t t1 = now_ns();
+    stats.header_ns = t1 - t0;
+    if (ret == 0) {
+        ret = read_patterns();
+    }
+    uint64_t t2 = now_ns();
+    stats.patterns_ns = t2 - t1;
+    if (ret == 0) {
+        ret = read_instrument();
+        stats.instruments_ns = now_ns() - t2;
+    }
+    if (ret == 0 && !probed) {
+        ret = bind_sample_arena();
+    } else if (ret == 0) {
+        cache_map.reset(); // probed samples hold no PCM
+    }
+    if (ret) {
+        load_jobs.clear();
+        close_xm();
+        orig_fd.reset();
+        return FILE_READ_ERROR;
+    }
+    if (!load_jobs.empty()) {
+        run_load_jobs();
+    }
+    if (load_error) {
+        XM_LOGE("Corrupt pattern data\n");
+        close_xm();
+        orig_fd.reset();
         return FILE_READ_ERROR;
     }
-    read_patterns();
-    read_instrument();
+    if ((load_flags & XM_LOAD_KEEP_SOURCE) && !probed) {
+        keep_source();
+    }
     close_xm();
+    stats.load_ns = now_ns() - load_start;
     return 0;
 }
 
-int XMFile::save_as(const char *filename) {
-    xm_file = fopen(filename, "wb");
+// The mapping is shared as is, a read buffer is taken over, caller memory is copied
+void XMFile::keep_source() {
+    if (src_map) {
+        orig_hold = src_map;
+        orig_data = src_data;
+    } else if (!src_buf.empty() && src_data == src_buf.data()) {
+        std::shared_ptr<std::vector<uint8_t> > buf = std::make_shared<std::vector<uint8_t> >(std::move(src_buf));
+        orig_hold = buf;
+        orig_data = buf->data();
+    } else {
+        std::shared_ptr<std::vector<uint8_t> > buf = std::make_shared<std::vector<uint8_t> >(src_data, src_data + src_size);
+        orig_hold = buf;
+        orig_data = buf->data();
+        stats.load_allocs++;
+    }
+    orig_size = src_size;
+}
+
+static size_t file_sink(const void *data, size_t len, void *user) {
+    return fwrite(data, 1, len, (FILE *)user);
+}
+
+static size_t memory_sink(const void *data, size_t len, void *user) {
+    std::vector<uint8_t> *out = (std::vector<uint8_t> *)user;
+    out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    return len;
+}
+
+#ifdef XM_HAVE_UNISTD
+static size_t fd_sink(const void *data, size_t len, void *user) {
+    int fd = *(int *)user;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const uint8_t *)data + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+#endif
+
+// Small writes are gathered in out_buf, anything at least a buffer long goes straight to the sink
+void XMFile::write_bytes(const void *data, size_t len) {
+    if (out_len + len > out_buf.size()) {
+        flush_out();
+        if (len >= out_buf.size()) {
+            sink(data, len);
+            return;
+        }
+    }
+    memcpy(out_buf.data() + out_len, data, len);
+    out_len += len;
+}
+
+void XMFile::flush_out() {
+    if (out_len) {
+        sink(out_buf.data(), out_len);
+    }
+    out_len = 0;
+}
+
+// Clean data from the kept source. Large ranges are copied file to file in the kernel when
+// both ends are files, anything copy_file_range() refuses (pipes, other filesystems) is written.
+void XMFile::write_source(size_t offset, size_t len) {
+    stats.copied_bytes += len;
+#ifdef XM_HAVE_COPY_RANGE
+    if (out_fd >= 0 && orig_fd && len >= XM_WRITE_BUF_SIZE && !out_error) {
+        flush_out();
+        loff_t off = offset;
+        uint64_t t0 = now_ns();
+        while (len) {
+            ssize_t n = copy_file_range(*orig_fd, &off, out_fd, NULL, len, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            stats.write_calls++;
+            stats.bytes_written += n;
+            len -= n;
+        }
+        stats.write_ns += now_ns() - t0;
+        offset = off;
+    }
+#endif
+    write_bytes(orig_data + offset, len);
+}
+
+void XMFile::sink(const void *data, size_t len) {
+    if (out_error) {
+        return;
+    }
+    uint64_t t0 = now_ns();
+    size_t done = out_cb(data, len, out_user);
+    stats.write_ns += now_ns() - t0;
+    stats.write_calls++;
+    stats.bytes_written += done;
+    if (done != len) {
+        out_error = true;
+    }
+}
+
+// One forward pass, block sizes are computed before each block is written so the sink never seeks
+int XMFile::save_to_callback(xm_write_cb_t cb, void *user) {
+    if (cb == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    if (probed) {
+        return FILE_WRITE_ERROR; // no cells or PCM to write
+    }
+    uint64_t start = now_ns();
+    begin_write(cb, user);
+    if (save_flags & XM_SAVE_MERGE_INSTRUMENTS) {
+        merge_duplicate_instruments();
+    }
+    save_pattern_map.clear();
+    if (save_flags & XM_SAVE_DEDUP_PATTERNS) {
+        // Duplicates take their first copy's index among the patterns actually written
+        find_duplicate_patterns(save_pattern_map, dedup_keys, pattern_scratch);
+        uint16_t written = 0;
+        for (size_t i = 0; i < save_pattern_map.size(); i++) {
+            save_pattern_map[i] = save_pattern_map[i] == i ? written++ : save_pattern_map[save_pattern_map[i]];
+        }
+    }
     write_metadata();
     write_header();
     write_patterns();
     write_instrument();
-    close_xm();
-    printf("Save sucess.\n");
+    return end_write(start);
+}
+
+void XMFile::begin_write(xm_write_cb_t cb, void *user) {
+    stats.encode_ns = stats.write_ns = stats.save_ns = 0;
+    stats.bytes_written = 0;
+    stats.write_calls = stats.save_allocs = 0;
+    stats.copied_bytes = 0;
+    out_cb = cb;
+    out_user = user;
+    size_t cap = out_buf.capacity();
+    out_buf.resize(XM_WRITE_BUF_SIZE);
+    stats.save_allocs += grew(out_buf, cap);
+    out_len = 0;
+    out_error = false;
+}
+
+int XMFile::end_write(uint64_t start) {
+    flush_out();
+    out_cb = NULL;
+    out_user = NULL;
+    stats.save_ns = now_ns() - start;
+    if (out_error) {
+        XM_LOGE("Write Error!\n");
+        return FILE_WRITE_ERROR;
+    }
+    XM_LOGI("Save sucess.\n");
+    return 0;
+}
+
+int XMFile::save_to_memory(std::vector<uint8_t> &out) {
+    out.clear();
+    return save_to_callback(memory_sink, &out);
+}
+
+int XMFile::save_to_fd(int fd) {
+#ifdef XM_HAVE_UNISTD
+    out_fd = fd;
+    int ret = save_to_callback(fd_sink, &fd);
+    out_fd = -1;
+    return ret;
+#else
+    return FILE_OPEN_ERROR;
+#endif
+}
+
+#ifdef XM_HAVE_UNISTD
+// Saving over the XM_LOAD_KEEP_SOURCE file would truncate what write_source() copies from
+static bool is_same_file(int fd, const char *filename, struct stat *st) {
+    struct stat src;
+    return stat(filename, st) == 0 && fstat(fd, &src) == 0 && st->st_dev == src.st_dev && st->st_ino == src.st_ino;
+}
+#endif
+
+int XMFile::save_as(const char *filename) {
+    if (probed) {
+        return FILE_WRITE_ERROR; // before the file is truncated
+    }
+    FILE *f = NULL;
+    std::string tmp_name; // the source is replaced by rename(), its old inode stays readable
+#ifdef XM_HAVE_UNISTD
+    struct stat st;
+    if (orig_fd && is_same_file(*orig_fd, filename, &st)) {
+        tmp_name = std::string(filename) + ".XXXXXX";
+        int fd = mkstemp(&tmp_name[0]);
+        if (fd < 0) {
+            return FILE_OPEN_ERROR;
+        }
+        fchmod(fd, st.st_mode & 07777);
+        f = fdopen(fd, "wb");
+        if (f == NULL) {
+            close(fd);
+            remove(tmp_name.c_str());
+            return FILE_OPEN_ERROR;
+        }
+    }
+#endif
+    if (f == NULL) {
+        f = fopen(filename, "wb");
+    }
+    if (f == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    setvbuf(f, NULL, _IONBF, 0); // writes already arrive in XM_WRITE_BUF_SIZE chunks
+#ifdef XM_HAVE_UNISTD
+    out_fd = fileno(f); // nothing is buffered in f, copy_file_range() can append to it
+#endif
+    int ret = save_to_callback(file_sink, f);
+    out_fd = -1;
+    if (fclose(f) != 0 && ret == 0) {
+        ret = FILE_WRITE_ERROR;
+    }
+    if (!tmp_name.empty()) {
+        if (ret == 0 && rename(tmp_name.c_str(), filename) != 0) {
+            ret = FILE_WRITE_ERROR;
+        }
+        if (ret) {
+            remove(tmp_name.c_str());
+        }
+    }
+    return ret;
+}
+// Native cache file: a cache header, then a body laid out like the module in memory.
+// Offsets in the body are relative to its start, bulk data is 16-byte aligned so PCM can
+// be used straight from the mapping.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  // 0x01020304 as written, a foreign-endian file won't match
+    uint32_t unit_size;   // sizeof(xm_unit_t)
+    uint32_t reserved[3];
+} xm_cache_header_t;
+
+// Per sample, after its 40-byte header (lengths in samples)
+typedef struct {
+    uint32_t kind;        // XM_CACHE_PCM*
+    uint32_t shared;      // PCM shared with another sample (XM_LOAD_DEDUP_SAMPLES)
+    uint64_t offset;      // of the data in the body
+    uint64_t bytes;
+} xm_cache_sample_t;
+
+#define XM_CACHE_EMPTY 0
+#define XM_CACHE_PCM8  1
+#define XM_CACHE_PCM16 2
+#define XM_CACHE_ADPCM 3 // table + nibbles as in the file, then the block keys
+
+static const char cache_magic[8] = {'X', 'M', 'C', 'A', 'C', 'H', 'E', 0};
+
+void XMFile::write_align() {
+    static const uint8_t zero[16] = {0};
+    size_t pos = stats.bytes_written + out_len - sizeof(xm_cache_header_t);
+    if (pos & 15) {
+        write_bytes(zero, 16 - (pos & 15));
+    }
+}
+
+// FILE_READ_ERROR if a lazy pattern turns out corrupt, the output is incomplete then
+int XMFile::write_cache() {
+    xm_cache_header_t ch;
+    memset(&ch, 0, sizeof(ch));
+    memcpy(ch.magic, cache_magic, sizeof(ch.magic));
+    ch.version = XM_CACHE_VERSION;
+    ch.byte_order = 0x01020304;
+    ch.unit_size = sizeof(xm_unit_t);
+    write_bytes(&ch, sizeof(ch));
+    header.numPatterns = pattern.size();
+    header.numInstruments = instrument.size();
+    write_metadata();
+    write_header();
+
+    for (uint16_t i = 0; i < header.numPatterns; i++) {
+        size_t cells = (size_t)pattern[i]->numRows * header.numChannels;
+        write_bytes(&pattern[i]->numRows, 2);
+        write_bytes(&pattern[i]->type, 1);
+        write_align();
+        const xm_unit_t *data = pattern_cells(i, pattern_scratch[0]);
+        if (data == NULL) {
+            XM_LOGE("Corrupt pattern data in #%d\n", i);
+            return FILE_READ_ERROR;
+        }
+        write_bytes(data, cells * sizeof(xm_unit_t));
+    }
+
+    // Shared PCM is written once, later samples point at the first copy
+    std::vector<std::pair<const void *, uint64_t> > blobs;
+    for (uint16_t i = 0; i < header.numInstruments; i++) {
+        xm_instrument_t *inst = &instrument[i];
+        inst->numSamples = inst->sample.size();
+        inst->size = inst->numSamples ? 29 + 234 : 29;
+        write_bytes(inst, 29);
+        if (inst->numSamples == 0) {
+            continue;
+        }
+        write_bytes(&inst->sampleHeaderSize, 234);
+        uint32_t env[2] = {(uint32_t)inst->volEnvTable.size(), (uint32_t)inst->panEnvTable.size()};
+        write_bytes(env, sizeof(env));
+        if (env[0]) {
+            write_bytes(inst->volEnvTable.data(), env[0] * sizeof(int16_t));
+        }
+        if (env[1]) {
+            write_bytes(inst->panEnvTable.data(), env[1] * sizeof(int16_t));
+        }
+        for (int n = 0; n < inst->numSamples; n++) {
+            xm_sample_t *smp = &inst->sample[n];
+            smp->length = xm_sample_length(smp);
+            xm_cache_sample_t cs = {XM_CACHE_EMPTY, smp->shared, 0, 0};
+            const void *data = NULL;
+            if (xm_sample_is_packed(smp)) {
+                cs.kind = XM_CACHE_ADPCM;
+                data = smp->adpcm.data();
+                cs.bytes = smp->adpcm.size() + smp->adpcm_keys.size();
+            } else if (smp->length) {
+                cs.kind = smp->type.sample_bit ? XM_CACHE_PCM16 : XM_CACHE_PCM8;
+                data = smp->type.sample_bit ? (const void *)smp->data.data() : (const void *)smp->data8.data();
+                cs.bytes = (size_t)smp->length * (smp->type.sample_bit ? 2 : 1);
+            }
+            bool first = true;
+            for (size_t b = 0; smp->shared && b < blobs.size(); b++) {
+                if (blobs[b].first == data) {
+                    cs.offset = blobs[b].second;
+                    first = false;
+                    break;
+                }
+            }
+            size_t pos = stats.bytes_written + out_len - sizeof(xm_cache_header_t) + 40 + sizeof(cs);
+            if (first) {
+                cs.offset = (pos + 15) & ~(size_t)15;
+            }
+            write_bytes(smp, 40);
+            write_bytes(&cs, sizeof(cs));
+            if (first && cs.kind == XM_CACHE_ADPCM) {
+                write_align();
+                write_bytes(data, smp->adpcm.size());
+                write_bytes(smp->adpcm_keys.data(), smp->adpcm_keys.size());
+            } else if (first && cs.bytes) {
+                write_align();
+                write_bytes(data, cs.bytes);
+                blobs.push_back(std::make_pair(data, cs.offset));
+            }
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int XMFile::save_cache(const char *filename) {
+    if (probed) {
+        return FILE_WRITE_ERROR;
+    }
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    uint64_t start = now_ns();
+    begin_write(file_sink, f);
+    save_pattern_map.clear();
+    int ret = write_cache();
+    int write_ret = end_write(start);
+    if (ret == 0) {
+        ret = write_ret;
+    }
+    if (fclose(f) != 0 && ret == 0) {
+        ret = FILE_WRITE_ERROR;
+    }
+    if (ret) {
+        remove(filename); // a partial cache file must not be opened later
+    }
+    return ret;
+}
+
+int XMFile::read_cache() {
+    if (read_metadata() || read_header()) {
+        return FILE_READ_ERROR;
+    }
+    size_t cap = pattern.capacity();
+    pattern.resize(header.numPatterns);
+    stats.load_allocs += grew(pattern, cap);
+    for (uint16_t i = 0; i < header.numPatterns; i++) {
+        if (!pattern[i] || pattern[i].use_count() > 1) {
+            pattern[i] = std::make_shared<xm_pattern_t>();
+            stats.load_allocs++;
+        }
+        xm_pattern_t *pat = pattern[i].get();
+        if (read_bytes(&pat->numRows, 2) || read_bytes(&pat->type, 1)) {
+            return FILE_READ_ERROR;
+        }
+        src_pos = (src_pos + 15) & ~(size_t)15;
+        size_t cells = (size_t)pat->numRows * header.numChannels;
+        const xm_unit_t *src = (const xm_unit_t *)read_ptr(cells * sizeof(xm_unit_t));
+        if (src == NULL) {
+            return FILE_READ_ERROR;
+        }
+        size_t cells_cap = pat->unpk_pattern.capacity();
+        pat->unpk_pattern.assign(src, src + cells);
+        stats.load_allocs += grew(pat->unpk_pattern, cells_cap);
+        pat->packed.clear();
+        pat->unpacked = true;
+        pat->headerLength = 9;
+        pat->dirty = true;
+    }
+
+    cap = instrument.capacity();
+    instrument.resize(header.numInstruments);
+    stats.load_allocs += grew(instrument, cap);
+    for (uint16_t i = 0; i < header.numInstruments; i++) {
+        xm_instrument_t *inst = &instrument[i];
+        if (read_bytes(inst, 29)) {
+            return FILE_READ_ERROR;
+        }
+        inst->volEnvTable.clear();
+        inst->panEnvTable.clear();
+        if (inst->numSamples == 0) {
+            inst->sample.clear();
+            continue;
+        }
+        uint32_t env[2];
+        if (read_bytes(&inst->sampleHeaderSize, 234) || read_bytes(env, sizeof(env))) {
+            return FILE_READ_ERROR;
+        }
+        const int16_t *vol = (const int16_t *)read_ptr((size_t)env[0] * sizeof(int16_t));
+        const int16_t *pan = (const int16_t *)read_ptr((size_t)env[1] * sizeof(int16_t));
+        if ((env[0] && vol == NULL) || (env[1] && pan == NULL)) {
+            return FILE_READ_ERROR;
+        }
+        size_t vol_cap = inst->volEnvTable.capacity(), pan_cap = inst->panEnvTable.capacity();
+        inst->volEnvTable.assign(vol, vol + env[0]);
+        inst->panEnvTable.assign(pan, pan + env[1]);
+        stats.load_allocs += grew(inst->volEnvTable, vol_cap) + grew(inst->panEnvTable, pan_cap);
+        size_t smp_cap = inst->sample.capacity();
+        inst->sample.resize(inst->numSamples);
+        stats.load_allocs += grew(inst->sample, smp_cap);
+        for (int n = 0; n < inst->numSamples; n++) {
+            xm_sample_t *smp = &inst->sample[n];
+            xm_cache_sample_t cs;
+            if (read_bytes(smp, 40) || read_bytes(&cs, sizeof(cs)) || cs.offset > src_size || cs.bytes > src_size - cs.offset) {
+                return FILE_READ_ERROR;
+            }
+            const uint8_t *data = src_data + cs.offset;
+            smp->data.release();
+            smp->data8.release();
+            smp->adpcm.clear();
+            smp->adpcm_keys.clear();
+            smp->play = NULL;
+            smp->shared = cs.shared != 0;
+            smp->hold.reset();
+            smp->dirty = true;
+            size_t width = cs.kind == XM_CACHE_PCM16 ? 2 : 1;
+            if (cs.kind != XM_CACHE_EMPTY && cs.kind != XM_CACHE_ADPCM && (cs.offset & (width - 1) || cs.bytes != smp->length * width)) {
+                return FILE_READ_ERROR;
+            }
+            if (cs.kind == XM_CACHE_PCM16) { // the mapping is private, edits in place stay in this process
+                smp->data.bind((int16_t *)data, smp->length);
+            } else if (cs.kind == XM_CACHE_PCM8) {
+                smp->data8.bind((int8_t *)data, smp->length);
+            } else if (cs.kind == XM_CACHE_ADPCM) {
+                size_t packed = 16 + (smp->length + 1) / 2, keys = smp->length / XM_ADPCM_BLOCK + 1;
+                if (cs.bytes != packed + keys) {
+                    return FILE_READ_ERROR;
+                }
+                size_t adpcm_cap = smp->adpcm.capacity(), key_cap = smp->adpcm_keys.capacity();
+                smp->adpcm.assign(data, data + packed);
+                smp->adpcm_keys.assign((const int8_t *)data + packed, (const int8_t *)data + packed + keys);
+                stats.load_allocs += grew(smp->adpcm, adpcm_cap) + grew(smp->adpcm_keys, key_cap);
+            }
+            if (cs.offset + cs.bytes > src_pos) {
+                src_pos = cs.offset + cs.bytes;
+            }
+        }
+    }
+    return 0;
+}
+
+int XMFile::open_cache(const char *filename) {
+    begin_load();
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return FILE_OPEN_ERROR;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < (long)sizeof(xm_cache_header_t)) {
+        fclose(f);
+        return FILE_TYPE_ERROR;
+    }
+    uint8_t *image = NULL;
+    bool mapped = false;
+#ifdef XM_HAVE_MMAP
+    // Writable but private: in-place edits of the PCM never reach the file
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (map != MAP_FAILED) {
+        image = (uint8_t *)map;
+        mapped = true;
+    }
+#endif
+    if (image == NULL) {
+        image = (uint8_t *)malloc(size);
+        if (image == NULL || fread(image, 1, size, f) != (size_t)size) {
+            free(image);
+            fclose(f);
+            return FILE_READ_ERROR;
+        }
+        stats.load_allocs++;
+    }
+    fclose(f);
+    stats.read_calls++;
+    stats.bytes_read = size;
+
+    xm_cache_header_t ch;
+    memcpy(&ch, image, sizeof(ch));
+    if (memcmp(ch.magic, cache_magic, sizeof(ch.magic)) != 0 || ch.version != XM_CACHE_VERSION ||
+        ch.byte_order != 0x01020304 || ch.unit_size != sizeof(xm_unit_t)) {
+        XM_LOGE("Not a cache file of this build: %s\n", filename);
+#ifdef XM_HAVE_MMAP
+        if (mapped) {
+            munmap(image, size);
+        }
+#endif
+        if (!mapped) {
+            free(image);
+        }
+        return FILE_TYPE_ERROR;
+    }
+    // Samples are rebound below, the previous image can go
+#ifdef XM_HAVE_MMAP
+    if (mapped) {
+        size_t map_size = size;
+        cache_map.reset(image, [map_size](void *p) { munmap(p, map_size); });
+    }
+#endif
+    if (!mapped) {
+        cache_map.reset(image, free);
+    }
+    if (!(load_flags & XM_LOAD_KEEP_BUFFERS) || sample_arena.use_count() > 1) {
+        sample_arena.reset();
+        sample_arena_size = 0;
+    }
+
+    probed = false;
+    src_data = image + sizeof(xm_cache_header_t);
+    src_size = size - sizeof(xm_cache_header_t);
+    src_pos = 0;
+    int ret = read_cache();
+    src_data = NULL;
+    src_size = 0;
+    src_pos = 0;
+    if (ret) {
+        // Samples not reached yet still point into the image or arena released above
+        XM_LOGE("Corrupt cache file: %s\n", filename);
+        pattern.clear();
+        instrument.clear();
+        header.numPatterns = 0;
+        header.numInstruments = 0;
+        cache_map.reset();
+    }
+    stats.load_ns = now_ns() - load_start;
+    return ret;
+}
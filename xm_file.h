@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <memory>
+#include <new>
+#include <utility>
 #include <vector>
 
 #include "xm_helper.h"
@@ -46,9 +49,139 @@ typedef struct {
     uint16_t numRows = 64;
     uint16_t packedPatternSize = 0;
 
-    std::vector<std::vector<xm_unit_t>> unpk_pattern;
+    uint32_t fileOffset = 0; // offset of the packed data in the source file
+    uint16_t fileSize = 0;   // packed size in the source file, packedPatternSize changes on eviction
+    bool dirty = true;       // cells differ from the kept source file (XM_LOAD_KEEP_SOURCE), set by get_pattern()
+    std::vector<uint8_t> packed; // packed data, kept until the pattern is unpacked (lazy mode) or evicted
+    bool unpacked = false;
+
+    std::vector<xm_unit_t> unpk_pattern; // numRows * numChannels cells, row-major
 } xm_pattern_t;
 
+// 2D view over a pattern's cells, valid until the pattern is evicted or resized
+typedef struct {
+    xm_unit_t *cells = NULL;
+    uint16_t rows = 0;
+    uint16_t channels = 0;
+
+    xm_unit_t *row(int r) const { return cells + (size_t)r * channels; }
+    xm_unit_t &at(int r, int c) const { return cells[(size_t)r * channels + c]; }
+} xm_pattern_view_t;
+
+// Read-only view, as returned by peek_pattern_view()
+typedef struct {
+    const xm_unit_t *cells = NULL;
+    uint16_t rows = 0;
+    uint16_t channels = 0;
+
+    const xm_unit_t *row(int r) const { return cells + (size_t)r * channels; }
+    const xm_unit_t &at(int r, int c) const { return cells[(size_t)r * channels + c]; }
+} xm_pattern_cview_t;
+
+// Sample PCM: a span into the module's sample arena after loading, or an owned heap
+// buffer once the sample is resized (editing, width conversion). Copies of an arena
+// span share its memory and stay valid only while the XMFile keeps that arena.
+template <typename T>
+class xm_pcm_t {
+private:
+    T *ptr = NULL;
+    size_t len = 0;
+    size_t cap = 0; // owned capacity, 0 for arena spans
+
+public:
+    xm_pcm_t() {}
+    xm_pcm_t(const xm_pcm_t &other) { *this = other; }
+    xm_pcm_t(xm_pcm_t &&other) noexcept : ptr(other.ptr), len(other.len), cap(other.cap) {
+        other.ptr = NULL;
+        other.len = other.cap = 0;
+    }
+    ~xm_pcm_t() { release(); }
+
+    xm_pcm_t &operator=(const xm_pcm_t &other) {
+        if (this == &other) {
+            return *this;
+        }
+        if (other.cap == 0) {
+            bind(other.ptr, other.len);
+            return *this;
+        }
+        clear();
+        resize(other.len);
+        memcpy(ptr, other.ptr, len * sizeof(T));
+        return *this;
+    }
+    xm_pcm_t &operator=(xm_pcm_t &&other) noexcept {
+        if (this != &other) {
+            release();
+            ptr = other.ptr;
+            len = other.len;
+            cap = other.cap;
+            other.ptr = NULL;
+            other.len = other.cap = 0;
+        }
+        return *this;
+    }
+
+    T *data() { return ptr; }
+    const T *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    size_t capacity() const { return cap; }
+    T &operator[](size_t i) { return ptr[i]; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+
+    void bind(T *p, size_t n) {
+        release();
+        ptr = p;
+        len = n;
+    }
+    void clear() {
+        if (cap == 0) {
+            ptr = NULL;
+        }
+        len = 0;
+    }
+    T *disown() { // hands an owned buffer to the caller, this stays a span over it
+        cap = 0;
+        return ptr;
+    }
+    void detach() { // copies an arena span out to owned memory
+        if (cap == 0 && len) {
+            resize(len);
+        }
+    }
+    void release() {
+        if (cap) {
+            free(ptr);
+        }
+        ptr = NULL;
+        len = cap = 0;
+    }
+    // New elements are zero, an arena span is copied out to owned memory first
+    void resize(size_t n) {
+        if (cap && n <= cap) {
+            if (n > len) {
+                memset(ptr + len, 0, (n - len) * sizeof(T));
+            }
+            len = n;
+            return;
+        }
+        T *p = (T *)malloc((n ? n : 1) * sizeof(T));
+        if (p == NULL) {
+            throw std::bad_alloc();
+        }
+        size_t keep = len < n ? len : n;
+        if (keep) {
+            memcpy(p, ptr, keep * sizeof(T));
+        }
+        memset(p + keep, 0, (n - keep) * sizeof(T));
+        release();
+        ptr = p;
+        len = n;
+        cap = n ? n : 1;
+    }
+};
+
 typedef struct {
     uint32_t length = 0;
     uint32_t loopStart = 0;
@@ -61,9 +194,43 @@ typedef struct {
     uint8_t sampleType = 0; // 0x00 = Regular DPCM data, 0xAD = 4bit ADPCM-compressed data
     char name[22];
 
-    std::vector<int16_t> data; // unpacked sample
+    xm_pcm_t<int16_t> data;     // unpacked 16-bit PCM (type.sample_bit = 1)
+    xm_pcm_t<int8_t> data8;     // unpacked 8-bit PCM (type.sample_bit = 0), kept at its native width
+    std::vector<uint8_t> adpcm; // XM_LOAD_KEEP_ADPCM: 16-byte delta table + 4-bit codes, data/data8 stay empty
+    std::vector<int8_t> adpcm_keys; // value before each XM_ADPCM_BLOCK samples, for random access
+    bool shared = false;        // PCM shared with other samples or clones, xm_sample_set() copies it out
+    std::shared_ptr<void> hold; // XMFile::clone(): edited PCM this sample shares with other modules
+
+    // XM_LOAD_KEEP_SOURCE: the encoded data in the kept source file, saved as is while the
+    // sample is clean and would be encoded the same way. The xm_sample_*() edits set dirty,
+    // direct writes to data/data8 must set it too.
+    uint32_t fileOffset = 0;
+    uint32_t fileSize = 0;
+    uint8_t fileType = 0; // 0xAD for ADPCM bytes, 0 for DPCM
+    bool dirty = true;
+
+    // XM_LOAD_PAD_LOOPS: playback PCM at the sample's width, data/data8 itself unless data follows
+    // the loop end. XM_PAD_GUARD samples before 0 and after play_loop_end are readable, ping-pong
+    // loops are unrolled, so [play_loop_start, play_loop_end) always loops forward (empty = no loop).
+    // Edits through the xm_sample_*() functions drop it.
+    const void *play = NULL;
+    uint32_t play_loop_start = 0;
+    uint32_t play_loop_end = 0;
 } xm_sample_t;
 
+#define XM_ADPCM_BLOCK 256
+#define XM_PAD_GUARD 8
+
+// Width-independent access to xm_sample_t PCM, 8-bit samples read back as value << 8
+size_t xm_sample_length(const xm_sample_t *smp);
+int16_t xm_sample_get(const xm_sample_t *smp, size_t pos);
+void xm_sample_set(xm_sample_t *smp, size_t pos, int16_t val);
+void xm_sample_to_16bit(xm_sample_t *smp);
+void xm_sample_to_8bit(xm_sample_t *smp);
+bool xm_sample_is_packed(const xm_sample_t *smp); // still 4-bit ADPCM in memory
+void xm_sample_decode(const xm_sample_t *smp, size_t pos, int8_t *out, size_t count); // packed samples only
+void xm_sample_unpack(xm_sample_t *smp);
+
 typedef struct __attribute__((packed)) {
     uint32_t size = 263;
     char name[22] = "New Instrument";
@@ -103,41 +270,246 @@ typedef struct __attribute__((packed)) {
     std::vector<int16_t> panEnvTable;
 } xm_instrument_t;
 
-void unpack_xm_pattern(const std::vector<uint8_t>& data, std::vector<std::vector<xm_unit_t>>& unpack_data, int rows, int channels);
-void pack_xm_pattern(std::vector<std::vector<xm_unit_t>>& unpack_data, std::vector<uint8_t>& packed_data, int rows, int channels);
+// 0, or FILE_READ_ERROR when the data is truncated or longer than the cells. readable is
+// how many bytes at data may be read (>= size), enough for the worst case skips bounds checks.
+int unpack_xm_pattern(const uint8_t* data, size_t size, std::vector<xm_unit_t>& unpack_data, int rows, int channels,
+                      size_t readable = 0);
+void pack_xm_pattern(std::vector<xm_unit_t>& unpack_data, std::vector<uint8_t>& packed_data, int rows, int channels);
 
 #define FILE_OPEN_ERROR -1
 #define FILE_TYPE_ERROR -2
 #define FILE_READ_ERROR -3
+#define FILE_WRITE_ERROR -4
+
+// Deferred pattern unpack (pat) or sample decode (smp) of size bytes/samples at src
+typedef struct {
+    const uint8_t *src;
+    size_t size;
+    xm_pattern_t *pat;
+    xm_sample_t *smp;
+    size_t readable = 0;  // bytes readable at src, see unpack_xm_pattern()
+    bool failed = false;  // corrupt pattern data
+} xm_load_job_t;
+
+// Load/save accounting, see XMFile::get_stats(). Times are wall-clock ns.
+typedef struct {
+    // Load, reset by every open_xm*()
+    uint64_t metadata_ns = 0;      // file read / mmap and module id
+    uint64_t header_ns = 0;
+    uint64_t patterns_ns = 0;      // pattern headers, plus unpacking when serial
+    uint64_t instruments_ns = 0;   // instrument/sample headers and envelope tables, decode excluded
+    uint64_t sample_decode_ns = 0; // DPCM decode, summed over threads
+    uint64_t parallel_ns = 0;      // wall time of the queued decode pass (all samples, patterns with set_load_threads())
+    uint64_t load_ns = 0;          // open_xm*() to the end of read_all()
+    uint64_t bytes_read = 0;
+    uint32_t read_calls = 0;       // fread / mmap calls
+    uint32_t load_allocs = 0;      // buffers allocated or grown by the loader
+    uint32_t dedup_samples = 0;    // XM_LOAD_DEDUP_SAMPLES: samples sharing another sample's PCM
+    uint64_t dedup_bytes = 0;      // PCM bytes those samples didn't need
+
+    // Save, reset by every save_*()
+    uint64_t encode_ns = 0;        // pattern packing and DPCM encoding
+    uint64_t write_ns = 0;         // time spent in the output sink
+    uint64_t save_ns = 0;
+    uint64_t bytes_written = 0;
+    uint32_t write_calls = 0;      // output sink calls
+    uint32_t save_allocs = 0;
+    uint64_t copied_bytes = 0;     // XM_LOAD_KEEP_SOURCE: unedited pattern/sample data written from the source
+
+    // Resident bytes, summed when get_stats() is called
+    size_t pattern_bytes = 0;
+    size_t sample_bytes = 0;
+    size_t envelope_bytes = 0;
+    size_t buffer_bytes = 0;       // loader and saver scratch kept for the next load / save
+} xm_stats_t;
+
+// Calls cb once per field with its name, for exporting to a metrics system
+void xm_stats_foreach(const xm_stats_t *stats, void (*cb)(const char *name, uint64_t value, void *user), void *user);
+
+// Sink for save_to_callback(), returns the number of bytes consumed (short count = error)
+typedef size_t (*xm_write_cb_t)(const void *data, size_t len, void *user);
+
+#define XM_WRITE_BUF_SIZE (64 * 1024)
+#define XM_CACHE_VERSION 1 // save_cache() format, open_cache() rejects any other
+
+// Log levels, a message is delivered when its level <= the level set with set_log()
+#define XM_LOG_NONE  -1
+#define XM_LOG_ERROR 0
+#define XM_LOG_INFO  1 // load/save progress
+#define XM_LOG_DEBUG 2 // full dump of every header, keymap and envelope LUT
+
+// Messages above this level are compiled out, e.g. -DXM_LOG_MAX_LEVEL=0 keeps errors only
+#ifndef XM_LOG_MAX_LEVEL
+#define XM_LOG_MAX_LEVEL XM_LOG_DEBUG
+#endif
+
+// msg is a formatted fragment, a dump line may arrive in several pieces
+typedef void (*xm_log_cb_t)(int level, const char *msg, void *user);
+void xm_log_stdout(int level, const char *msg, void *user); // the verbose dump sink
+
+// Load flags
+#define XM_LOAD_LAZY_PATTERNS 0x0001 // keep patterns packed, unpack on first get_pattern()
+#define XM_LOAD_KEEP_BUFFERS  0x0002 // keep the file buffer's capacity for the next open_xm() on this object
+#define XM_LOAD_ENV_TABLES    0x0004 // also fill volEnvTable/panEnvTable (genEnvTable), playback uses env_cursor_t
+#define XM_LOAD_KEEP_ADPCM    0x0008 // keep 4-bit ADPCM samples packed, see xm_sample_decode()
+#define XM_LOAD_DEDUP_SAMPLES 0x0010 // samples with identical data share one PCM buffer, decoded once
+#define XM_LOAD_PAD_LOOPS     0x0020 // build xm_sample_t::play, guard samples for branchless interpolation
+#define XM_LOAD_PROBE         0x0040 // headers only: no pattern cells or sample PCM, the module can't be saved
+#define XM_LOAD_KEEP_SOURCE   0x0080 // keep the file after loading, save_*() copies unedited patterns and samples from it
+
+// Save flags
+#define XM_SAVE_ADPCM         0x0001 // write 8-bit samples as 4-bit ADPCM (lossy, 0xAD)
+#define XM_SAVE_MERGE_INSTRUMENTS 0x0002 // merge_duplicate_instruments() before writing
+#define XM_SAVE_DEDUP_PATTERNS 0x0004 // write identical patterns once and remap the order table (module unchanged)
 
 class XMFile {
 private:
-    FILE *xm_file = NULL;
-
     char xm_file_name[256];
 
+    // Source bytes of the module being parsed (owned buffer, mmap or caller memory)
+    const uint8_t *src_data = NULL;
+    size_t src_size = 0;
+    size_t src_pos = 0;
+    std::vector<uint8_t> src_buf;
+    std::shared_ptr<void> src_map;
+
+    uint32_t load_flags = 0;
+    uint32_t save_flags = 0;
+    bool probed = false; // loaded with XM_LOAD_PROBE, patterns and samples are headers only
+    unsigned int load_threads = 1;
+    std::vector<xm_load_job_t> load_jobs;
+    bool load_error = false; // a load job failed, read_all() rejects the module
+    // Memory sample PCM points into, clones share it: decoded PCM of every sample (see
+    // bind_sample_arena()), or the open_cache() image
+    std::shared_ptr<void> sample_arena;
+    size_t sample_arena_size = 0;
+    std::shared_ptr<void> cache_map;
+    // XM_LOAD_KEEP_SOURCE: the loaded file, shared with clones. The descriptor is kept for
+    // copy_file_range() when the module was read from a file.
+    std::shared_ptr<void> orig_hold;
+    const uint8_t *orig_data = NULL;
+    size_t orig_size = 0;
+    std::shared_ptr<int> orig_fd;
+    int out_fd = -1; // save_as() / save_to_fd() target, for copy_file_range()
+    std::vector<std::pair<uint64_t, uint32_t> > dedup_keys; // content hash, load job (or pattern when saving)
+    std::vector<std::pair<xm_sample_t *, xm_sample_t *> > dedup_links; // duplicate, first copy
+    std::vector<xm_unit_t> pattern_scratch[2]; // lazy patterns unpacked for comparison
+    std::vector<uint16_t> save_pattern_map;   // XM_SAVE_DEDUP_PATTERNS: pattern -> written index
+
+    xm_stats_t stats;
+    uint64_t load_start = 0;
+
+    // Output of the save_*() functions, written strictly forward through out_buf
+    xm_write_cb_t out_cb = NULL;
+    void *out_user = NULL;
+    std::vector<uint8_t> out_buf;
+    size_t out_len = 0;
+    bool out_error = false;
+    std::vector<uint8_t> enc_buf; // packed pattern / encoded sample scratch, reused across saves
+
+    int log_level = XM_LOG_ERROR;
+    xm_log_cb_t log_cb = xm_log_stdout;
+    void *log_user = NULL;
+
+    bool log_enabled(int level) const {
+        return level <= XM_LOG_MAX_LEVEL && level <= log_level && log_cb != NULL;
+    }
+    void log(int level, const char *fmt, ...) const __attribute__((format(printf, 3, 4)));
+    void dump_envelope(const char *name, const env_point_t *env, uint8_t num, env_type_t type,
+                       uint8_t sus, uint8_t loop_start, uint8_t loop_end, const std::vector<int16_t> &table);
+
     xm_metadata_t metadata;
     xm_header_t header;
-    std::vector<xm_pattern_t> pattern;
+    std::vector<std::shared_ptr<xm_pattern_t> > pattern; // shared with clones until get_pattern()
     std::vector<xm_instrument_t> instrument;
 
+    const uint8_t *read_ptr(size_t len);
+    int read_bytes(void *dst, size_t len);
+    void write_bytes(const void *data, size_t len);
+    void flush_out();
+    void write_source(size_t offset, size_t len);
+    void sink(const void *data, size_t len);
+    void begin_load();
+    int attach_source(const char* filename);
+    void keep_source();
+
     int read_metadata();
     void write_metadata();
     void close_xm();
     int read_header();
     void write_header();
-    void read_patterns();
+    int read_patterns();
     void write_patterns();
     void print_pattern(uint16_t num, int startChl, int endChl, int startRow, int endRow);
-    void read_instrument();
+    int read_instrument();
     void write_instrument();
     void write_samples(xm_instrument_t *inst);
-    void read_samples(xm_instrument_t *inst);
+    int read_samples(xm_instrument_t *inst);
+    void add_load_job(const xm_load_job_t &job);
+    uint32_t run_load_job(xm_load_job_t &job);
+    void run_load_jobs();
+    void dedup_sample_jobs();
+    int bind_sample_arena();
+    bool unpack_pattern(xm_pattern_t *pat);
+    const xm_unit_t *pattern_cells(uint16_t num, std::vector<xm_unit_t> &scratch) const;
+    uint16_t find_duplicate_patterns(std::vector<uint16_t> &map, std::vector<std::pair<uint64_t, uint32_t> > &keys,
+                                     std::vector<xm_unit_t> *scratch) const;
+    void begin_write(xm_write_cb_t cb, void *user);
+    int end_write(uint64_t start);
+    void write_align();
+    int write_cache();
+    int read_cache();
 
 public:
+    XMFile() {}
+    XMFile(XMFile &&other) = default;
+    XMFile &operator=(XMFile &&other) = default;
+    XMFile(const XMFile &other) = delete; // clone() shares the data instead
+    XMFile &operator=(const XMFile &other) = delete;
+    ~XMFile();
+
+    // Snapshot for undo or a working copy in O(headers): pattern cells and sample PCM are
+    // shared until one side writes them through get_pattern() or xm_sample_*()
+    XMFile clone();
+
     int open_xm(const char* filename);
+    int open_xm_mmap(const char* filename);
+    int open_xm_memory(const uint8_t* data, size_t size);
+    int load_from_memory(const uint8_t* data, size_t size);
+    int probe_xm(const char* filename); // open_xm_mmap() + read_all() with XM_LOAD_PROBE
     int read_all();
-    int save_as(const char *filename);
+    int save_as(const char *filename); // over the XM_LOAD_KEEP_SOURCE file: written beside it, then renamed
+    int save_to_fd(int fd); // pipes and sockets work, nothing is seeked
+    int save_to_memory(std::vector<uint8_t> &out);
+    int save_to_callback(xm_write_cb_t cb, void *user);
+    // Native cache of the decoded module: open_cache() copies the pattern cells and envelope
+    // tables and uses the sample PCM in place from a private mapping, nothing is decoded
+    int save_cache(const char *filename);
+    int open_cache(const char *filename);
+
+    void set_log(int level, xm_log_cb_t cb = xm_log_stdout, void *user = NULL);
+    const xm_stats_t &get_stats();
+    const xm_metadata_t *get_metadata() const;
+    const xm_header_t *get_header() const;
+    uint16_t get_num_instruments() const;
+    xm_instrument_t *get_instrument(uint16_t num);
+    const xm_instrument_t *get_instrument(uint16_t num) const;
+    void set_load_flags(uint32_t flags);
+    void set_load_threads(unsigned int threads);
+    void set_save_flags(uint32_t flags);
+    uint16_t get_num_patterns() const;
+    xm_pattern_t *get_pattern(uint16_t num); // for writing, a pattern shared with a clone is copied first
+    xm_pattern_view_t get_pattern_view(uint16_t num);
+    xm_pattern_cview_t peek_pattern_view(uint16_t num); // for reading, never copies
+    xm_pattern_cview_t peek_pattern_view(uint16_t num) const; // never unpacks, a packed pattern reads as missing
+    bool is_pattern_dirty(uint16_t num) const; // edited since loading, see XM_LOAD_KEEP_SOURCE
+    void evict_pattern(uint16_t num);
+    // map[i] = first instrument identical to i (samples, envelopes, keymap; names ignored),
+    // the dedup functions find nothing after XM_LOAD_PROBE
+    uint16_t find_duplicate_instruments(std::vector<uint16_t> &map) const;
+    uint16_t merge_duplicate_instruments(); // drops duplicates, patterns are renumbered
+    // map[i] = first pattern with the same rows and cells as i, lazy patterns stay packed
+    uint16_t find_duplicate_patterns(std::vector<uint16_t> &map) const;
 };
 
 #endif
\ No newline at end of file
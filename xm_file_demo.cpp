@@ -1,13 +1,17 @@
 #include <stdio.h>
+#include <string.h>
 #include "xm_file.h"
 
 XMFile xmfile;
 
 int main(int argc, char **argv) {
     if (argc < 3) {
-        printf("Usage: %s <input .XM> <output .XM>\n", argv[0]);
+        printf("Usage: %s <input .XM> <output .XM> [-v]\n", argv[0]);
         return -1;
     }
+    if (argc > 3 && strcmp(argv[3], "-v") == 0) {
+        xmfile.set_log(XM_LOG_DEBUG);
+    }
     xmfile.open_xm(argv[1]);
     xmfile.read_all();
     xmfile.save_as(argv[2]);
@@ -1,5 +1,21 @@
 #include "xm_helper.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(XM_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#define XM_DPCM_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XM_DPCM_AVX2 1
+#endif
+#elif (defined(__ARM_NEON) || defined(__aarch64__)) && !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define XM_DPCM_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
 const char note_table[12][3] = {"C-", "C#", "D-", "D#", "E-", "F-", "F#", "G-", "G#", "A-", "A#", "B-"};
 
 void xm_note_to_str(uint8_t note, char output[4]) {
@@ -59,12 +75,20 @@ void parse_vol_cmd(uint8_t vol_cmd, char* mnemonic, uint8_t* val) {
     }
 }
 
-size_t encode_dpcm_8bit(int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
-    dpcm_data[0] = pcm_data[0];
-    int16_t accumulated_error = 0;
+/*
+ * DPCM kernels
+ *
+ * Decoding is a prefix sum, encoding a delta with error carry on overflow. Every
+ * kernel below is bit-exact with the scalar reference; the SIMD encoders only take
+ * the vector path for blocks with no overflow and no pending error, anything else
+ * goes through the scalar loop so the error carry behaves exactly the same.
+ */
+
+static size_t encode8_range(const int8_t* pcm_data, int8_t* dpcm_data, size_t i, size_t end, int16_t* error) {
+    int16_t accumulated_error = *error;
     size_t error_count = 0;
 
-    for (size_t i = 1; i < num_samples; ++i) {
+    for (; i < end; ++i) {
         int16_t diff = pcm_data[i] - pcm_data[i - 1] + accumulated_error;
 
         if (diff > 127) {
@@ -81,15 +105,15 @@ size_t encode_dpcm_8bit(int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples)
 
         dpcm_data[i] = (int8_t)diff;
     }
+    *error = accumulated_error;
     return error_count;
 }
 
-size_t encode_dpcm_16bit(int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
-    dpcm_data[0] = pcm_data[0];
-    int32_t accumulated_error = 0;
+static size_t encode16_range(const int16_t* pcm_data, int16_t* dpcm_data, size_t i, size_t end, int32_t* error) {
+    int32_t accumulated_error = *error;
     size_t error_count = 0;
 
-    for (size_t i = 1; i < num_samples; ++i) {
+    for (; i < end; ++i) {
         int32_t diff = pcm_data[i] - pcm_data[i - 1] + accumulated_error;
 
         if (diff > 32767) {
@@ -106,20 +130,573 @@ size_t encode_dpcm_16bit(int16_t* pcm_data, int16_t* dpcm_data, size_t num_sampl
 
         dpcm_data[i] = (int16_t)diff;
     }
+    *error = accumulated_error;
     return error_count;
 }
 
-void decode_dpcm_8bit(int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
-    pcm_data[0] = dpcm_data[0];
-    for (size_t i = 1; i < num_samples; ++i) {
-        pcm_data[i] = pcm_data[i - 1] + dpcm_data[i];
+static size_t encode8_scalar(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
+    int16_t error = 0;
+    return encode8_range(pcm_data, dpcm_data, 1, num_samples, &error);
+}
+
+static size_t encode16_scalar(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
+    int32_t error = 0;
+    return encode16_range(pcm_data, dpcm_data, 1, num_samples, &error);
+}
+
+static void decode8_scalar(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
+    int8_t acc = 0;
+    for (size_t i = 0; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = acc;
+    }
+}
+
+static void decode8to16_scalar(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    int8_t acc = 0;
+    for (size_t i = 0; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = (int16_t)(acc * 256);
+    }
+}
+
+// dpcm_data may be unaligned (e.g. straight out of a mmap'ed file)
+static void decode16_scalar(const void* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const uint8_t* src = (const uint8_t*)dpcm_data;
+    int16_t acc = 0;
+    for (size_t i = 0; i < num_samples; ++i) {
+        int16_t d;
+        memcpy(&d, src + i * 2, 2);
+        acc += d;
+        pcm_data[i] = acc;
+    }
+}
+
+#if defined(XM_DPCM_SSE2)
+static size_t encode8_sse2(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int16_t error = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        if (error == 0) {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(pcm_data + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(pcm_data + i - 1));
+            __m128i d = _mm_sub_epi8(cur, prev);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_subs_epi8(cur, prev))) == 0xFFFF) {
+                _mm_storeu_si128((__m128i*)(dpcm_data + i), d);
+                continue;
+            }
+        }
+        error_count += encode8_range(pcm_data, dpcm_data, i, i + 16, &error);
+    }
+    return error_count + encode8_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+static size_t encode16_sse2(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int32_t error = 0;
+    for (; i + 8 <= num_samples; i += 8) {
+        if (error == 0) {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(pcm_data + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(pcm_data + i - 1));
+            __m128i d = _mm_sub_epi16(cur, prev);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(d, _mm_subs_epi16(cur, prev))) == 0xFFFF) {
+                _mm_storeu_si128((__m128i*)(dpcm_data + i), d);
+                continue;
+            }
+        }
+        error_count += encode16_range(pcm_data, dpcm_data, i, i + 8, &error);
+    }
+    return error_count + encode16_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+static inline __m128i prefix_sum_epi8_sse2(__m128i x) {
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+}
+
+// Broadcast byte 15 to all lanes (SSE2 has no pshufb)
+static inline __m128i last_epi8_sse2(__m128i x) {
+    x = _mm_unpackhi_epi8(x, x);
+    x = _mm_shufflehi_epi16(x, 0xFF);
+    return _mm_unpackhi_epi64(x, x);
+}
+
+static void decode8_sse2(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        __m128i x = prefix_sum_epi8_sse2(_mm_loadu_si128((const __m128i*)(dpcm_data + i)));
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128((__m128i*)(pcm_data + i), x);
+        carry = last_epi8_sse2(x);
+    }
+    int8_t acc = i ? pcm_data[i - 1] : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = acc;
+    }
+}
+
+static void decode8to16_sse2(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry = zero;
+    size_t i = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        __m128i x = prefix_sum_epi8_sse2(_mm_loadu_si128((const __m128i*)(dpcm_data + i)));
+        x = _mm_add_epi8(x, carry);
+        // interleaving a zero low byte is the << 8 widening
+        _mm_storeu_si128((__m128i*)(pcm_data + i), _mm_unpacklo_epi8(zero, x));
+        _mm_storeu_si128((__m128i*)(pcm_data + i + 8), _mm_unpackhi_epi8(zero, x));
+        carry = last_epi8_sse2(x);
+    }
+    int8_t acc = i ? (int8_t)(pcm_data[i - 1] >> 8) : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = (int16_t)(acc * 256);
+    }
+}
+
+static void decode16_sse2(const void* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const uint8_t* src = (const uint8_t*)dpcm_data;
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= num_samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi16(x, carry);
+        _mm_storeu_si128((__m128i*)(pcm_data + i), x);
+        carry = _mm_shufflehi_epi16(x, 0xFF);
+        carry = _mm_unpackhi_epi64(carry, carry);
+    }
+    if (i < num_samples) {
+        int16_t acc = i ? pcm_data[i - 1] : 0;
+        decode16_scalar(src + i * 2, pcm_data + i, num_samples - i);
+        for (; i < num_samples; ++i) {
+            pcm_data[i] += acc;
+        }
+    }
+}
+#endif
+
+#if defined(XM_DPCM_AVX2)
+#define XM_AVX2 __attribute__((target("avx2")))
+
+XM_AVX2 static size_t encode8_avx2(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int16_t error = 0;
+    for (; i + 32 <= num_samples; i += 32) {
+        if (error == 0) {
+            __m256i cur = _mm256_loadu_si256((const __m256i*)(pcm_data + i));
+            __m256i prev = _mm256_loadu_si256((const __m256i*)(pcm_data + i - 1));
+            __m256i d = _mm256_sub_epi8(cur, prev);
+            if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(d, _mm256_subs_epi8(cur, prev))) == 0xFFFFFFFFu) {
+                _mm256_storeu_si256((__m256i*)(dpcm_data + i), d);
+                continue;
+            }
+        }
+        error_count += encode8_range(pcm_data, dpcm_data, i, i + 32, &error);
+    }
+    return error_count + encode8_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+XM_AVX2 static size_t encode16_avx2(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int32_t error = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        if (error == 0) {
+            __m256i cur = _mm256_loadu_si256((const __m256i*)(pcm_data + i));
+            __m256i prev = _mm256_loadu_si256((const __m256i*)(pcm_data + i - 1));
+            __m256i d = _mm256_sub_epi16(cur, prev);
+            if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(d, _mm256_subs_epi16(cur, prev))) == 0xFFFFFFFFu) {
+                _mm256_storeu_si256((__m256i*)(dpcm_data + i), d);
+                continue;
+            }
+        }
+        error_count += encode16_range(pcm_data, dpcm_data, i, i + 16, &error);
+    }
+    return error_count + encode16_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+// Prefix sum over 32 bytes: in-lane log-step scan, then carry the low lane's total into the high lane
+XM_AVX2 static inline __m256i prefix_sum_epi8_avx2(__m256i x) {
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+    __m256i last = _mm256_shuffle_epi8(x, _mm256_set1_epi8(15));
+    return _mm256_add_epi8(x, _mm256_permute2x128_si256(last, last, 0x08));
+}
+
+XM_AVX2 static inline __m256i last_epi8_avx2(__m256i x) {
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, _mm256_set1_epi8(15)), 0xFF);
+}
+
+XM_AVX2 static void decode8_avx2(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
+    __m256i carry = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= num_samples; i += 32) {
+        __m256i x = prefix_sum_epi8_avx2(_mm256_loadu_si256((const __m256i*)(dpcm_data + i)));
+        x = _mm256_add_epi8(x, carry);
+        _mm256_storeu_si256((__m256i*)(pcm_data + i), x);
+        carry = last_epi8_avx2(x);
+    }
+    int8_t acc = i ? pcm_data[i - 1] : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = acc;
     }
 }
 
-void decode_dpcm_16bit(int16_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
-    pcm_data[0] = dpcm_data[0];
-    for (size_t i = 1; i < num_samples; ++i) {
-        pcm_data[i] = pcm_data[i - 1] + dpcm_data[i];
+XM_AVX2 static void decode8to16_avx2(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i carry = zero;
+    size_t i = 0;
+    for (; i + 32 <= num_samples; i += 32) {
+        __m256i x = prefix_sum_epi8_avx2(_mm256_loadu_si256((const __m256i*)(dpcm_data + i)));
+        x = _mm256_add_epi8(x, carry);
+        carry = last_epi8_avx2(x);
+        // qword order 0,2,1,3 so the in-lane unpacks come out in sample order
+        x = _mm256_permute4x64_epi64(x, 0xD8);
+        _mm256_storeu_si256((__m256i*)(pcm_data + i), _mm256_unpacklo_epi8(zero, x));
+        _mm256_storeu_si256((__m256i*)(pcm_data + i + 16), _mm256_unpackhi_epi8(zero, x));
+    }
+    int8_t acc = i ? (int8_t)(pcm_data[i - 1] >> 8) : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = (int16_t)(acc * 256);
+    }
+}
+
+XM_AVX2 static void decode16_avx2(const void* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const uint8_t* src = (const uint8_t*)dpcm_data;
+    __m256i carry = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i * 2));
+        x = _mm256_add_epi16(x, _mm256_slli_si256(x, 2));
+        x = _mm256_add_epi16(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi16(x, _mm256_slli_si256(x, 8));
+        __m256i last = _mm256_shufflehi_epi16(x, 0xFF);
+        last = _mm256_unpackhi_epi64(last, last);
+        x = _mm256_add_epi16(x, _mm256_permute2x128_si256(last, last, 0x08));
+        x = _mm256_add_epi16(x, carry);
+        _mm256_storeu_si256((__m256i*)(pcm_data + i), x);
+        last = _mm256_shufflehi_epi16(x, 0xFF);
+        carry = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(last, last), 0xFF);
+    }
+    if (i < num_samples) {
+        int16_t acc = i ? pcm_data[i - 1] : 0;
+        decode16_scalar(src + i * 2, pcm_data + i, num_samples - i);
+        for (; i < num_samples; ++i) {
+            pcm_data[i] += acc;
+        }
+    }
+}
+#endif
+
+#if defined(XM_DPCM_NEON)
+static inline bool all_set_u8_neon(uint8x16_t eq) {
+    uint64x2_t v = vreinterpretq_u64_u8(eq);
+    return (vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) == ~(uint64_t)0;
+}
+
+static size_t encode8_neon(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int16_t error = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        if (error == 0) {
+            int8x16_t cur = vld1q_s8(pcm_data + i);
+            int8x16_t prev = vld1q_s8(pcm_data + i - 1);
+            int8x16_t d = vsubq_s8(cur, prev);
+            if (all_set_u8_neon(vceqq_s8(d, vqsubq_s8(cur, prev)))) {
+                vst1q_s8(dpcm_data + i, d);
+                continue;
+            }
+        }
+        error_count += encode8_range(pcm_data, dpcm_data, i, i + 16, &error);
+    }
+    return error_count + encode8_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+static size_t encode16_neon(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
+    size_t i = 1, error_count = 0;
+    int32_t error = 0;
+    for (; i + 8 <= num_samples; i += 8) {
+        if (error == 0) {
+            int16x8_t cur = vld1q_s16(pcm_data + i);
+            int16x8_t prev = vld1q_s16(pcm_data + i - 1);
+            int16x8_t d = vsubq_s16(cur, prev);
+            if (all_set_u8_neon(vreinterpretq_u8_u16(vceqq_s16(d, vqsubq_s16(cur, prev))))) {
+                vst1q_s16(dpcm_data + i, d);
+                continue;
+            }
+        }
+        error_count += encode16_range(pcm_data, dpcm_data, i, i + 8, &error);
+    }
+    return error_count + encode16_range(pcm_data, dpcm_data, i, num_samples, &error);
+}
+
+static inline int8x16_t prefix_sum_s8_neon(int8x16_t x) {
+    const int8x16_t zero = vdupq_n_s8(0);
+    x = vaddq_s8(x, vextq_s8(zero, x, 15));
+    x = vaddq_s8(x, vextq_s8(zero, x, 14));
+    x = vaddq_s8(x, vextq_s8(zero, x, 12));
+    return vaddq_s8(x, vextq_s8(zero, x, 8));
+}
+
+static void decode8_neon(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
+    int8x16_t carry = vdupq_n_s8(0);
+    size_t i = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        int8x16_t x = vaddq_s8(prefix_sum_s8_neon(vld1q_s8(dpcm_data + i)), carry);
+        vst1q_s8(pcm_data + i, x);
+        carry = vdupq_n_s8(vgetq_lane_s8(x, 15));
+    }
+    int8_t acc = i ? pcm_data[i - 1] : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = acc;
+    }
+}
+
+static void decode8to16_neon(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    int8x16_t carry = vdupq_n_s8(0);
+    size_t i = 0;
+    for (; i + 16 <= num_samples; i += 16) {
+        int8x16_t x = vaddq_s8(prefix_sum_s8_neon(vld1q_s8(dpcm_data + i)), carry);
+        vst1q_s16(pcm_data + i, vshll_n_s8(vget_low_s8(x), 8));
+        vst1q_s16(pcm_data + i + 8, vshll_n_s8(vget_high_s8(x), 8));
+        carry = vdupq_n_s8(vgetq_lane_s8(x, 15));
+    }
+    int8_t acc = i ? (int8_t)(pcm_data[i - 1] >> 8) : 0;
+    for (; i < num_samples; ++i) {
+        acc += dpcm_data[i];
+        pcm_data[i] = (int16_t)(acc * 256);
+    }
+}
+
+static void decode16_neon(const void* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    const uint8_t* src = (const uint8_t*)dpcm_data;
+    const int16x8_t zero = vdupq_n_s16(0);
+    int16x8_t carry = zero;
+    size_t i = 0;
+    for (; i + 8 <= num_samples; i += 8) {
+        int16x8_t x = vreinterpretq_s16_u8(vld1q_u8(src + i * 2));
+        x = vaddq_s16(x, vextq_s16(zero, x, 7));
+        x = vaddq_s16(x, vextq_s16(zero, x, 6));
+        x = vaddq_s16(x, vextq_s16(zero, x, 4));
+        x = vaddq_s16(x, carry);
+        vst1q_s16(pcm_data + i, x);
+        carry = vdupq_n_s16(vgetq_lane_s16(x, 7));
+    }
+    if (i < num_samples) {
+        int16_t acc = i ? pcm_data[i - 1] : 0;
+        decode16_scalar(src + i * 2, pcm_data + i, num_samples - i);
+        for (; i < num_samples; ++i) {
+            pcm_data[i] += acc;
+        }
+    }
+}
+#endif
+
+typedef struct {
+    const char *name;
+    size_t (*encode8)(const int8_t*, int8_t*, size_t);
+    size_t (*encode16)(const int16_t*, int16_t*, size_t);
+    void (*decode8)(const int8_t*, int8_t*, size_t);
+    void (*decode8to16)(const int8_t*, int16_t*, size_t);
+    void (*decode16)(const void*, int16_t*, size_t);
+} dpcm_kernels_t;
+
+static const dpcm_kernels_t dpcm_scalar = {"scalar", encode8_scalar, encode16_scalar, decode8_scalar, decode8to16_scalar, decode16_scalar};
+#if defined(XM_DPCM_SSE2)
+static const dpcm_kernels_t dpcm_sse2 = {"sse2", encode8_sse2, encode16_sse2, decode8_sse2, decode8to16_sse2, decode16_sse2};
+#endif
+#if defined(XM_DPCM_AVX2)
+static const dpcm_kernels_t dpcm_avx2 = {"avx2", encode8_avx2, encode16_avx2, decode8_avx2, decode8to16_avx2, decode16_avx2};
+#endif
+#if defined(XM_DPCM_NEON)
+static const dpcm_kernels_t dpcm_neon = {"neon", encode8_neon, encode16_neon, decode8_neon, decode8to16_neon, decode16_neon};
+#endif
+
+static const dpcm_kernels_t *dpcm_best_kernels() {
+#if defined(XM_DPCM_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &dpcm_avx2;
+    }
+#endif
+#if defined(XM_DPCM_SSE2)
+    return &dpcm_sse2;
+#elif defined(XM_DPCM_NEON)
+    return &dpcm_neon;
+#else
+    return &dpcm_scalar;
+#endif
+}
+
+static const dpcm_kernels_t *dpcm_kernels = dpcm_best_kernels();
+
+void dpcm_set_simd(bool enable) {
+    dpcm_kernels = enable ? dpcm_best_kernels() : &dpcm_scalar;
+}
+
+bool dpcm_set_kernels(const char *name) {
+    static const dpcm_kernels_t *const all[] = {
+        &dpcm_scalar,
+#if defined(XM_DPCM_SSE2)
+        &dpcm_sse2,
+#endif
+#if defined(XM_DPCM_AVX2)
+        &dpcm_avx2,
+#endif
+#if defined(XM_DPCM_NEON)
+        &dpcm_neon,
+#endif
+    };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i]->name, name) != 0) {
+            continue;
+        }
+#if defined(XM_DPCM_AVX2)
+        if (all[i] == &dpcm_avx2 && !__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+#endif
+        dpcm_kernels = all[i];
+        return true;
+    }
+    return false;
+}
+
+const char *dpcm_simd_name() {
+    return dpcm_kernels->name;
+}
+
+size_t encode_dpcm_8bit(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples) {
+    if (num_samples == 0) return 0;
+    dpcm_data[0] = pcm_data[0];
+    return dpcm_kernels->encode8(pcm_data, dpcm_data, num_samples);
+}
+
+size_t encode_dpcm_16bit(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples) {
+    if (num_samples == 0) return 0;
+    dpcm_data[0] = pcm_data[0];
+    return dpcm_kernels->encode16(pcm_data, dpcm_data, num_samples);
+}
+
+void decode_dpcm_8bit(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples) {
+    dpcm_kernels->decode8(dpcm_data, pcm_data, num_samples);
+}
+
+void decode_dpcm_16bit(const int16_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    dpcm_kernels->decode16(dpcm_data, pcm_data, num_samples);
+}
+
+// 8-bit DPCM straight to 16-bit PCM (<< 8), no intermediate 8-bit buffer
+void decode_dpcm_8bit_to_16bit(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples) {
+    dpcm_kernels->decode8to16(dpcm_data, pcm_data, num_samples);
+}
+
+// 16-bit DPCM from raw little-endian bytes (may be unaligned, e.g. in a mmap'ed file)
+void decode_dpcm_16bit_le(const uint8_t* dpcm_bytes, int16_t* pcm_data, size_t num_samples) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int16_t acc = 0;
+    for (size_t i = 0; i < num_samples; ++i) {
+        acc += (int16_t)(dpcm_bytes[i * 2] | (dpcm_bytes[i * 2 + 1] << 8));
+        pcm_data[i] = acc;
+    }
+#else
+    dpcm_kernels->decode16(dpcm_bytes, pcm_data, num_samples);
+#endif
+}
+
+// ModPlug 4-bit ADPCM: a 16-entry delta table, then two samples per byte (low nibble first).
+// Decodes samples first .. first + num_samples - 1, acc is the value before sample first.
+int8_t decode_adpcm_4bit(const uint8_t* nibbles, const int8_t* table, int8_t acc, size_t first, int8_t* pcm_data, size_t num_samples) {
+    size_t i = 0;
+    if (num_samples && (first & 1)) {
+        acc += table[nibbles[first >> 1] >> 4];
+        pcm_data[i++] = acc;
+    }
+    const uint8_t* src = nibbles + ((first + i) >> 1);
+    for (; i + 1 < num_samples; i += 2) {
+        uint8_t b = *src++;
+        acc += table[b & 0x0F];
+        pcm_data[i] = acc;
+        acc += table[b >> 4];
+        pcm_data[i + 1] = acc;
+    }
+    if (i < num_samples) {
+        acc += table[*src & 0x0F];
+        pcm_data[i] = acc;
+    }
+    return acc;
+}
+
+// Tries the delta shape at scales from twice the largest delta down and keeps the table
+// with the least squared error. The encoder follows its own reconstruction, so errors
+// don't accumulate.
+void encode_adpcm_4bit(const int8_t* pcm_data, size_t num_samples, int8_t* table, uint8_t* nibbles) {
+    static const int8_t shape[16] = {0, 2, 5, 10, 18, 32, 56, 100, -2, -5, -10, -18, -32, -56, -100, -128};
+    int max_delta = 1;
+    int prev = 0;
+    for (size_t i = 0; i < num_samples; i++) {
+        int d = abs(pcm_data[i] - prev);
+        max_delta = d > max_delta ? d : max_delta;
+        prev = pcm_data[i];
+    }
+
+    int8_t best_table[16] = {0};
+    uint64_t best_err = UINT64_MAX;
+    for (int step = 0; step < 16; step++) {
+        int range = (int)(max_delta * 512 >> (step / 2)) / (step & 1 ? 362 : 256); // 2 * max_delta / sqrt(2)^step
+        int8_t cand[16];
+        for (int n = 0; n < 16; n++) {
+            int v = shape[n] * range / 128;
+            if (shape[n] && v == 0) {
+                v = shape[n] > 0 ? 1 : -1;
+            }
+            cand[n] = (int8_t)(v < -128 ? -128 : (v > 127 ? 127 : v));
+        }
+        uint64_t err = 0;
+        int8_t acc = 0;
+        for (size_t i = 0; i < num_samples && err < best_err; i++) {
+            int best = 0, best_d = 1 << 30;
+            for (int n = 0; n < 16; n++) {
+                int d = abs(pcm_data[i] - (int8_t)(acc + cand[n]));
+                if (d < best_d) {
+                    best_d = d;
+                    best = n;
+                }
+            }
+            acc += cand[best];
+            err += (uint64_t)best_d * best_d;
+        }
+        if (err < best_err) {
+            best_err = err;
+            memcpy(best_table, cand, 16);
+        }
+    }
+
+    memcpy(table, best_table, 16);
+    int8_t acc = 0;
+    memset(nibbles, 0, (num_samples + 1) / 2);
+    for (size_t i = 0; i < num_samples; i++) {
+        int best = 0, best_d = 1 << 30;
+        for (int n = 0; n < 16; n++) {
+            int d = abs(pcm_data[i] - (int8_t)(acc + table[n]));
+            if (d < best_d) {
+                best_d = d;
+                best = n;
+            }
+        }
+        acc += table[best];
+        nibbles[i >> 1] |= (i & 1) ? best << 4 : best;
     }
 }
 
@@ -156,4 +733,72 @@ void genEnvTable(const env_point_t* env_points, uint8_t num_points, std::vector<
             table[index++] = y_interpolated;
         }
     }
-}
\ No newline at end of file
+}
+
+static void env_cursor_segment(env_cursor_t* cur, uint8_t seg) {
+    cur->acc = 0;
+    if (seg + 1 >= cur->num) {
+        cur->seg = cur->num - 1;
+        cur->y0 = cur->points[cur->num - 1].y;
+        cur->inc = 0;
+        return;
+    }
+    const env_point_t& p0 = cur->points[seg];
+    const env_point_t& p1 = cur->points[seg + 1];
+    uint16_t segment_length = p1.x - p0.x;
+    cur->seg = seg;
+    cur->y0 = p0.y;
+    cur->inc = segment_length ? (int32_t)(p1.y - p0.y) * (1 << 16) / segment_length : 0;
+}
+
+void env_cursor_init(env_cursor_t* cur, const env_point_t* env_points, uint8_t num_points, env_type_t type,
+                     uint8_t sus, uint8_t loop_start, uint8_t loop_end) {
+    cur->points = env_points;
+    cur->num = num_points > 12 ? 12 : num_points;
+    cur->type = type;
+    cur->sus = sus;
+    cur->loop_start = loop_start;
+    cur->loop_end = loop_end;
+    env_cursor_seek(cur, 0);
+}
+
+// O(num_points), for (re)starts and the Lxx effect only
+void env_cursor_seek(env_cursor_t* cur, uint16_t x) {
+    cur->x = x;
+    if (cur->num == 0) {
+        cur->seg = 0;
+        cur->y0 = 0;
+        cur->inc = 0;
+        cur->acc = 0;
+        return;
+    }
+    uint8_t seg = 0;
+    while (seg + 1 < cur->num && x >= cur->points[seg + 1].x) {
+        seg++;
+    }
+    env_cursor_segment(cur, seg);
+    if (x > cur->points[seg].x && seg + 1 < cur->num) {
+        cur->acc = cur->inc * (x - cur->points[seg].x);
+    }
+}
+
+void env_cursor_step(env_cursor_t* cur, bool key_on) {
+    if (cur->num == 0) {
+        return;
+    }
+    const env_point_t* env = cur->points;
+    if (cur->type.sus && key_on && cur->sus < cur->num && cur->x == env[cur->sus].x) {
+        return;
+    }
+    if (cur->seg + 1 >= cur->num) {
+        return; // held at the last point
+    }
+    cur->x++;
+    cur->acc += cur->inc;
+    if (cur->type.loop && cur->loop_end < cur->num && cur->loop_start <= cur->loop_end && cur->x >= env[cur->loop_end].x) {
+        cur->x = env[cur->loop_start].x;
+        env_cursor_segment(cur, cur->loop_start);
+    } else if (cur->x >= env[cur->seg + 1].x) {
+        env_cursor_segment(cur, cur->seg + 1);
+    }
+}
@@ -2,6 +2,7 @@
 #define XM_HELPER_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <vector>
 
 #define IS_COMPRESSED_MODE(mask) ((mask) & 0x80)
@@ -25,6 +26,23 @@ typedef struct __attribute__((packed)) {
     bool loop : 1;
 } env_type_t;
 
+// Steps through an envelope one tick at a time without a table, O(1) per tick.
+// Node values are exact, in between it matches genEnvTable's interpolation.
+typedef struct {
+    const env_point_t *points = NULL;
+    uint8_t num = 0;
+    env_type_t type = {0, 0, 0};
+    uint8_t sus = 0;
+    uint8_t loop_start = 0;
+    uint8_t loop_end = 0;
+
+    uint8_t seg = 0;  // points[seg] .. points[seg + 1], num - 1 once past the last point
+    uint16_t x = 0;
+    int16_t y0 = 0;   // value at points[seg]
+    int32_t inc = 0;  // 16.16 per tick within the segment
+    int32_t acc = 0;  // inc * ticks into the segment
+} env_cursor_t;
+
 typedef struct __attribute__((packed)) {
     uint8_t loop_mode : 2; // 0 = No Loop, 1 = Forward Loop, 2 = Ping-pong
     uint8_t reserved : 2;
@@ -33,10 +51,22 @@ typedef struct __attribute__((packed)) {
 
 void xm_note_to_str(uint8_t note, char output[4]);
 void parse_vol_cmd(uint8_t vol_cmd, char* mnemonic, uint8_t* val);
-size_t encode_dpcm_8bit(int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples);
-size_t encode_dpcm_16bit(int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples);
-void decode_dpcm_8bit(int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples);
-void decode_dpcm_16bit(int16_t* dpcm_data, int16_t* pcm_data, size_t num_samples);
+size_t encode_dpcm_8bit(const int8_t* pcm_data, int8_t* dpcm_data, size_t num_samples);
+size_t encode_dpcm_16bit(const int16_t* pcm_data, int16_t* dpcm_data, size_t num_samples);
+void decode_dpcm_8bit(const int8_t* dpcm_data, int8_t* pcm_data, size_t num_samples);
+void decode_dpcm_16bit(const int16_t* dpcm_data, int16_t* pcm_data, size_t num_samples);
+void decode_dpcm_8bit_to_16bit(const int8_t* dpcm_data, int16_t* pcm_data, size_t num_samples);
+void decode_dpcm_16bit_le(const uint8_t* dpcm_bytes, int16_t* pcm_data, size_t num_samples);
+int8_t decode_adpcm_4bit(const uint8_t* nibbles, const int8_t* table, int8_t acc, size_t first, int8_t* pcm_data, size_t num_samples);
+void encode_adpcm_4bit(const int8_t* pcm_data, size_t num_samples, int8_t* table, uint8_t* nibbles);
+void dpcm_set_simd(bool enable); // runtime dispatch picks AVX2/SSE2/NEON, false forces the scalar kernels
+bool dpcm_set_kernels(const char *name); // "scalar", "sse2", "avx2" or "neon"; false if not built in or not supported
+const char *dpcm_simd_name();
 void genEnvTable(const env_point_t* env_points, uint8_t num_points, std::vector<int16_t>& table);
+void env_cursor_init(env_cursor_t* cur, const env_point_t* env_points, uint8_t num_points, env_type_t type,
+                     uint8_t sus, uint8_t loop_start, uint8_t loop_end);
+void env_cursor_seek(env_cursor_t* cur, uint16_t x);
+void env_cursor_step(env_cursor_t* cur, bool key_on); // sustain holds while key_on
+static inline int16_t env_cursor_value(const env_cursor_t* cur) { return cur->y0 + (cur->acc >> 16); }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,686 @@
+#include "xm_player.h"
+
+#include <string.h>
+#include <math.h>
+
+// 2^(i/768) in 16.16, one octave of the FT2 linear period scale (64 steps per semitone)
+static const uint32_t *pow2_table() {
+    static uint32_t table[768];
+    static bool init = []() {
+        for (int i = 0; i < 768; i++) {
+            table[i] = (uint32_t)lround(pow(2.0, i / 768.0) * 65536.0);
+        }
+        return true;
+    }();
+    (void)init;
+    return table;
+}
+
+// 2^(k/768) in 16.16
+static uint64_t pow2_fp(int32_t k) {
+    int32_t oct = k >= 0 ? k / 768 : -((-k + 767) / 768);
+    uint64_t v = pow2_table()[k - oct * 768];
+    return oct >= 0 ? v << oct : v >> -oct;
+}
+
+static const uint8_t vibrato_sine[32] = {
+    0, 24, 49, 74, 97, 120, 141, 161, 180, 197, 212, 224, 235, 244, 250, 253,
+    255, 253, 250, 244, 235, 224, 212, 197, 180, 161, 141, 120, 97, 74, 49, 24
+};
+
+static int32_t wave(uint8_t pos, uint8_t depth) {
+    int32_t v = vibrato_sine[pos & 31] * depth;
+    return (pos & 32) ? -v : v;
+}
+
+static int32_t clamp(int32_t v, int32_t lo, int32_t hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+XMPlayer::XMPlayer(const XMFile *xm, uint32_t sample_rate) : xm(xm), header(xm->get_header()), rate(sample_rate ? sample_rate : 44100) {
+    xm->find_duplicate_patterns(pattern_map);
+    reset();
+}
+
+// Unpack everything the song can reach now, render() must not allocate
+XMPlayer::XMPlayer(XMFile *xm, uint32_t sample_rate) : XMPlayer((const XMFile *)xm, sample_rate) {
+    for (uint16_t i = 0; i < header->songLength; i++) {
+        uint16_t num = header->orderTable[i];
+        xm->peek_pattern_view(num < pattern_map.size() ? pattern_map[num] : num);
+    }
+}
+
+void XMPlayer::reset(uint16_t start_order) {
+    num_channels = header->numChannels < XM_PLAYER_MAX_CHANNELS ? header->numChannels : XM_PLAYER_MAX_CHANNELS;
+    for (int ch = 0; ch < XM_PLAYER_MAX_CHANNELS; ch++) {
+        voice[ch] = xm_voice_t();
+    }
+    order = start_order < header->songLength ? start_order : 0;
+    row = 0;
+    tick = 0;
+    speed = header->defaultTempo ? header->defaultTempo : 6;
+    bpm = header->defaultBPM >= 32 ? header->defaultBPM : 125;
+    global_vol = 64;
+    pattern_delay = 0;
+    jump = false;
+    looped = false;
+    tick_left = 0;
+    tick_frac = 0;
+    voice_frames = 0;
+    amp = clamp(1024 / (num_channels ? num_channels : 1), 64, 256);
+}
+
+void XMPlayer::seek(const xm_timeline_row_t *at) {
+    reset(at->order);
+    row = at->row;
+    speed = at->speed;
+    bpm = at->bpm;
+    global_vol = at->global_vol;
+    tick_frac = at->tick_frac;
+}
+
+void XMPlayer::set_amp(int32_t q8) {
+    amp = q8;
+}
+
+uint16_t XMPlayer::get_order() {
+    return order;
+}
+
+uint16_t XMPlayer::get_row() {
+    return row;
+}
+
+bool XMPlayer::has_looped() {
+    return looped;
+}
+
+uint64_t XMPlayer::get_voice_frames() {
+    return voice_frames;
+}
+
+xm_pattern_cview_t XMPlayer::view_at(uint16_t ord) {
+    uint16_t num = header->orderTable[ord];
+    return xm->peek_pattern_view(num < pattern_map.size() ? pattern_map[num] : num);
+}
+
+int32_t XMPlayer::period_for(int32_t note64) {
+    if (header->freqMode) {
+        return 7680 - note64;
+    }
+    return (int32_t)((1712 * pow2_fp(3072 - note64)) >> 16); // Amiga, C-4 = 1712
+}
+
+uint32_t XMPlayer::step_for(int32_t period) {
+    if (period <= 0) {
+        return 0;
+    }
+    uint64_t freq;
+    if (header->freqMode) {
+        freq = (8363 * pow2_fp(4608 - period)) >> 16;
+    } else {
+        freq = 8363 * 1712 / period;
+    }
+    return (uint32_t)((freq << 16) / rate);
+}
+
+void XMPlayer::key_off(xm_voice_t *v) {
+    v->key_on = false;
+    if (v->inst == NULL || !v->inst->volType.on) {
+        v->volume = 0;
+    }
+}
+
+void XMPlayer::trigger(xm_voice_t *v, uint8_t note, uint8_t inst_num, bool porta) {
+    if (inst_num) {
+        v->inst_num = inst_num;
+    }
+    const xm_instrument_t *inst = v->inst_num ? xm->get_instrument(v->inst_num - 1) : NULL;
+
+    if (note >= 1 && note <= 96) {
+        const xm_sample_t *smp = NULL;
+        if (inst && inst->sampleKeymap[note - 1] < inst->sample.size()) {
+            smp = &inst->sample[inst->sampleKeymap[note - 1]];
+        }
+        if (smp == NULL) {
+            if (!porta) {
+                v->active = false;
+            }
+            return;
+        }
+        int32_t note64 = (note - 1 + smp->relNoteNum) * 64 + smp->finetune / 2;
+        if (porta && v->active) {
+            v->target_period = period_for(note64);
+        } else {
+            v->inst = inst;
+            v->smp = smp;
+            v->note64 = note64;
+            v->period = v->target_period = period_for(note64);
+            v->pos = 0;
+            v->dir = 1;
+            v->active = xm_sample_length(smp) > 0;
+            if (v->fx_cmd == 0x9) {
+                uint32_t offset = v->sample_offset * 256;
+                v->active = offset < xm_sample_length(smp);
+                v->pos = (int64_t)offset << 16;
+            }
+            v->vibrato_pos = 0;
+            v->tremolo_pos = 0;
+        }
+    }
+
+    // The instrument column resets volume, panning and the envelopes
+    if (inst_num && v->smp) {
+        v->volume = v->smp->volume > 64 ? 64 : v->smp->volume;
+        v->panning = v->smp->panning;
+        v->key_on = true;
+        env_cursor_init(&v->vol_env, v->inst->volEnv, v->inst->numVolPoint, v->inst->volType,
+                        v->inst->volSusPoint, v->inst->volLoopStart, v->inst->volLoopEnd);
+        env_cursor_init(&v->pan_env, v->inst->panEnv, v->inst->numPanPoint, v->inst->panType,
+                        v->inst->panSusPoint, v->inst->panLoopStart, v->inst->panLoopEnd);
+        v->fadeout = 65536;
+    }
+}
+
+void XMPlayer::vol_slide(xm_voice_t *v, uint8_t val) {
+    if (val & 0xF0) {
+        v->volume = clamp(v->volume + (val >> 4), 0, 64);
+    } else {
+        v->volume = clamp(v->volume - (val & 0x0F), 0, 64);
+    }
+}
+
+void XMPlayer::process_row() {
+    xm_pattern_cview_t view = view_at(order);
+    if (view.cells == NULL || row >= view.rows) {
+        return;
+    }
+    const xm_unit_t *cells = view.row(row);
+    for (int ch = 0; ch < num_channels; ch++) {
+        xm_voice_t *v = &voice[ch];
+        const xm_unit_t &cell = cells[ch];
+        v->note = cell.note;
+        v->inst_num = cell.inst ? cell.inst : v->inst_num;
+        v->vol_cmd = cell.vol;
+        v->fx_cmd = cell.fx_cmd;
+        v->fx_val = cell.fx_val;
+        if (cell.fx_cmd == 0x9 && cell.fx_val) {
+            v->sample_offset = cell.fx_val;
+        }
+
+        bool porta = cell.fx_cmd == 0x3 || cell.fx_cmd == 0x5 || (cell.vol >> 4) == 0xF;
+        bool delayed = cell.fx_cmd == 0xE && (cell.fx_val >> 4) == 0xD && (cell.fx_val & 0x0F);
+        if (!delayed) {
+            if (cell.note == 97) {
+                key_off(v);
+            } else if (cell.note || cell.inst) {
+                trigger(v, cell.note, cell.inst, porta);
+            }
+        }
+        row_effects(v);
+    }
+}
+
+// Tick 0 part of the volume column and effect commands
+void XMPlayer::row_effects(xm_voice_t *v) {
+    uint8_t vol = v->vol_cmd, x = vol & 0x0F;
+    if (vol >= 0x10 && vol <= 0x50) {
+        v->volume = vol - 0x10;
+    } else if ((vol >> 4) == 0x8) {
+        v->volume = clamp(v->volume - x, 0, 64);
+    } else if ((vol >> 4) == 0x9) {
+        v->volume = clamp(v->volume + x, 0, 64);
+    } else if ((vol >> 4) == 0xA) {
+        v->vibrato_speed = x << 2;
+    } else if ((vol >> 4) == 0xB) {
+        if (x) v->vibrato_depth = x;
+    } else if ((vol >> 4) == 0xC) {
+        v->panning = x << 4;
+    } else if ((vol >> 4) == 0xF) {
+        if (x) v->tone_porta = x << 4;
+    }
+
+    uint8_t val = v->fx_val, hi = val >> 4, lo = val & 0x0F;
+    switch (v->fx_cmd) {
+    case 0x0:
+        v->arp_val = val;
+        break;
+    case 0x1:
+        if (val) v->porta_up = val;
+        break;
+    case 0x2:
+        if (val) v->porta_down = val;
+        break;
+    case 0x3:
+        if (val) v->tone_porta = val;
+        break;
+    case 0x4:
+        if (hi) v->vibrato_speed = hi << 2;
+        if (lo) v->vibrato_depth = lo;
+        break;
+    case 0x5:
+    case 0x6:
+    case 0xA:
+        if (val) v->vol_slide = val;
+        break;
+    case 0x7:
+        if (hi) v->tremolo_speed = hi << 2;
+        if (lo) v->tremolo_depth = lo;
+        break;
+    case 0x8:
+        v->panning = val;
+        break;
+    case 0xB:
+        if (!jump) {
+            jump_row = 0;
+        }
+        jump = true;
+        jump_order = val;
+        break;
+    case 0xC:
+        v->volume = val > 64 ? 64 : val;
+        break;
+    case 0xD:
+        if (!jump) {
+            jump_order = order + 1;
+        }
+        jump = true;
+        jump_row = hi * 10 + lo;
+        break;
+    case 0xE:
+        switch (hi) {
+        case 0x1:
+            if (lo) v->fine_porta_up = lo;
+            v->period = clamp(v->period - v->fine_porta_up * 4, 1, 32000);
+            break;
+        case 0x2:
+            if (lo) v->fine_porta_down = lo;
+            v->period = clamp(v->period + v->fine_porta_down * 4, 1, 32000);
+            break;
+        case 0x6:
+            if (lo == 0) {
+                v->loop_row = row;
+            } else if (v->loop_count == 0 || --v->loop_count) {
+                if (v->loop_count == 0) {
+                    v->loop_count = lo;
+                }
+                jump = true;
+                jump_order = order;
+                jump_row = v->loop_row;
+            }
+            break;
+        case 0xA:
+            if (lo) v->fine_vol_up = lo;
+            v->volume = clamp(v->volume + v->fine_vol_up, 0, 64);
+            break;
+        case 0xB:
+            if (lo) v->fine_vol_down = lo;
+            v->volume = clamp(v->volume - v->fine_vol_down, 0, 64);
+            break;
+        case 0xC:
+            if (lo == 0) v->volume = 0;
+            break;
+        case 0xE:
+            if (pattern_delay == 0) pattern_delay = lo + 1; // the row plays lo more times, the first EEx (even EE0) wins
+            break;
+        }
+        break;
+    case 0xF:
+        if (val && val < 32) {
+            speed = val;
+        } else if (val >= 32) {
+            bpm = val;
+        }
+        break;
+    case 0x10: // Gxx
+        global_vol = val > 64 ? 64 : val;
+        break;
+    case 0x11: // Hxy
+        if (val) v->global_vol_slide = val;
+        break;
+    case 0x14: // Kxx
+        if (val == 0) key_off(v);
+        break;
+    case 0x15: // Lxx
+        env_cursor_seek(&v->vol_env, val);
+        env_cursor_seek(&v->pan_env, val);
+        break;
+    }
+}
+
+// Ticks 1..speed-1
+void XMPlayer::tick_effects(xm_voice_t *v) {
+    uint8_t vol = v->vol_cmd, x = vol & 0x0F;
+    switch (vol >> 4) {
+    case 0x6:
+        v->volume = clamp(v->volume - x, 0, 64);
+        break;
+    case 0x7:
+        v->volume = clamp(v->volume + x, 0, 64);
+        break;
+    case 0xB:
+        v->period_ofs = wave(v->vibrato_pos, v->vibrato_depth) >> 5;
+        v->vibrato_pos += v->vibrato_speed >> 2;
+        break;
+    case 0xD:
+        v->panning = clamp(v->panning - x, 0, 255);
+        break;
+    case 0xE:
+        v->panning = clamp(v->panning + x, 0, 255);
+        break;
+    }
+
+    uint8_t val = v->fx_val, hi = val >> 4, lo = val & 0x0F;
+    bool tone_porta = v->fx_cmd == 0x3 || v->fx_cmd == 0x5 || (vol >> 4) == 0xF;
+    if (tone_porta && v->target_period) {
+        int32_t d = v->tone_porta * 4;
+        if (v->period < v->target_period) {
+            v->period = v->period + d > v->target_period ? v->target_period : v->period + d;
+        } else if (v->period > v->target_period) {
+            v->period = v->period - d < v->target_period ? v->target_period : v->period - d;
+        }
+    }
+
+    switch (v->fx_cmd) {
+    case 0x0:
+        if (val) {
+            int semis = (tick % 3) == 1 ? hi : ((tick % 3) == 2 ? lo : 0);
+            v->period_ofs = period_for(v->note64 + semis * 64) - period_for(v->note64);
+        }
+        break;
+    case 0x1:
+        v->period = clamp(v->period - v->porta_up * 4, 1, 32000);
+        break;
+    case 0x2:
+        v->period = clamp(v->period + v->porta_down * 4, 1, 32000);
+        break;
+    case 0x4:
+    case 0x6:
+        v->period_ofs = wave(v->vibrato_pos, v->vibrato_depth) >> 5;
+        v->vibrato_pos += v->vibrato_speed >> 2;
+        if (v->fx_cmd == 0x6) vol_slide(v, v->vol_slide);
+        break;
+    case 0x5:
+    case 0xA:
+        vol_slide(v, v->vol_slide);
+        break;
+    case 0x7:
+        v->volume_ofs = wave(v->tremolo_pos, v->tremolo_depth) >> 6;
+        v->tremolo_pos += v->tremolo_speed >> 2;
+        break;
+    case 0xE:
+        if (hi == 0xC && tick == lo) {
+            v->volume = 0;
+        } else if (hi == 0xD && tick == lo) {
+            if (v->note == 97) {
+                key_off(v);
+            } else {
+                trigger(v, v->note, v->inst_num, false);
+                row_effects(v); // volume column applies when the note starts
+            }
+        }
+        break;
+    case 0x11:
+        if (v->global_vol_slide & 0xF0) {
+            global_vol = clamp(global_vol + (v->global_vol_slide >> 4), 0, 64);
+        } else {
+            global_vol = clamp(global_vol - (v->global_vol_slide & 0x0F), 0, 64);
+        }
+        break;
+    case 0x14:
+        if (tick == val) key_off(v);
+        break;
+    }
+}
+
+// Envelopes, fadeout and pitch turn into the per-tick step and gains the mixer uses
+void XMPlayer::update_voice(xm_voice_t *v) {
+    const xm_instrument_t *inst = v->inst;
+    int32_t env_vol = 64, env_pan = 32;
+    if (inst) {
+        if (inst->volType.on && inst->numVolPoint >= 2) {
+            env_vol = env_cursor_value(&v->vol_env);
+            env_cursor_step(&v->vol_env, v->key_on);
+            if (!v->key_on) {
+                v->fadeout = v->fadeout > (uint32_t)inst->volFadeout * 2 ? v->fadeout - inst->volFadeout * 2 : 0;
+            }
+        }
+        if (inst->panType.on && inst->numPanPoint >= 2) {
+            env_pan = env_cursor_value(&v->pan_env);
+            env_cursor_step(&v->pan_env, v->key_on);
+        }
+    }
+
+    int32_t vol = clamp(v->volume + v->volume_ofs, 0, 64);
+    int64_t gain = (int64_t)vol * clamp(env_vol, 0, 64) * global_vol; // 0..2^18
+    gain = (gain * (v->fadeout >> 1)) >> 15;
+    gain >>= 8; // Q10
+    int32_t pan = v->panning + (clamp(env_pan, 0, 64) - 32) * (128 - abs(v->panning - 128)) / 32;
+    pan = clamp(pan, 0, 256);
+    v->gain_l = (int32_t)(gain * (256 - pan) >> 8);
+    v->gain_r = (int32_t)(gain * pan >> 8);
+
+    v->step = step_for(v->period + v->period_ofs);
+    v->period_ofs = 0;
+    v->volume_ofs = 0;
+}
+
+void XMPlayer::next_tick() {
+    if (tick == 0 && pattern_delay == 0) {
+        process_row();
+    } else {
+        for (int ch = 0; ch < num_channels; ch++) {
+            tick_effects(&voice[ch]);
+        }
+    }
+    for (int ch = 0; ch < num_channels; ch++) {
+        update_voice(&voice[ch]);
+    }
+
+    if (++tick < speed) {
+        return;
+    }
+    tick = 0;
+    if (pattern_delay) {
+        pattern_delay--;
+        if (pattern_delay) {
+            return;
+        }
+    }
+    xm_pattern_cview_t view = view_at(order);
+    if (jump) {
+        jump = false;
+        order = jump_order;
+        row = jump_row;
+    } else if (++row >= view.rows) {
+        row = 0;
+        order++;
+    }
+    if (order >= header->songLength) {
+        order = header->resetVector < header->songLength ? header->resetVector : 0;
+        looped = true;
+    }
+    if (row >= view_at(order).rows) {
+        row = 0;
+    }
+}
+
+// 15-bit fraction keeps (s1 - s0) * frac inside int32 for full-scale 16-bit steps
+static inline int32_t lerp(int32_t s0, int32_t s1, int64_t pos) {
+    return s0 + (((s1 - s0) * (int32_t)((pos & 0xFFFF) >> 1)) >> 15);
+}
+
+template <typename T, int SHIFT>
+struct pcm_source {
+    const T *data;
+    int32_t operator[](uint32_t idx) const { return data[idx] * (1 << SHIFT); }
+};
+
+// Packed samples are decoded a block at a time into the voice's window
+struct adpcm_source {
+    xm_voice_t *v;
+    int32_t operator[](uint32_t idx) const {
+        uint32_t off = idx - v->adpcm_start;
+        if (v->adpcm_smp != v->smp || off > XM_ADPCM_BLOCK) {
+            v->adpcm_smp = v->smp;
+            v->adpcm_start = idx - idx % XM_ADPCM_BLOCK;
+            xm_sample_decode(v->smp, v->adpcm_start, v->adpcm_buf, XM_ADPCM_BLOCK + 1);
+            off = idx - v->adpcm_start;
+        }
+        return v->adpcm_buf[off] * 256;
+    }
+};
+
+// Linear interpolation, 32.16 position. The fast loops run while every fetch (and the
+// sample after it) is inside the loop, the edges are handled one frame at a time.
+// Padded samples (XM_LOAD_PAD_LOOPS) loop forward and have a guard past the loop end,
+// so the fast loop runs up to the end and only the wrap is left to the slow path.
+template <typename Src>
+static void mix_samples(xm_voice_t *v, const Src &src, int32_t *out, size_t frames) {
+    const xm_sample_t *smp = v->smp;
+    uint32_t ls, le;
+    int mode;
+    int64_t guard = 0;
+    if (smp->play) {
+        ls = smp->play_loop_start;
+        le = smp->play_loop_end;
+        mode = ls < le ? 1 : 0;
+        ls = mode ? ls : 0;
+        guard = 1;
+    } else {
+        uint32_t length = xm_sample_length(smp);
+        ls = smp->loopStart;
+        le = smp->loopStart + smp->loopLength;
+        mode = smp->type.loop_mode;
+        if (mode == 0 || mode == 3 || smp->loopLength == 0 || ls >= length) {
+            mode = 0;
+            ls = 0;
+            le = length;
+        } else if (le > length) {
+            le = length;
+        }
+    }
+    const int64_t start_fp = (int64_t)ls << 16, end_fp = (int64_t)le << 16;
+    const int64_t safe_fp = (int64_t)(le - 1 + guard) << 16;
+    const int64_t step = v->step;
+    const int32_t gl = v->gain_l, gr = v->gain_r;
+    int64_t pos = v->pos;
+
+    size_t i = 0;
+    while (i < frames) {
+        if (step > 0 && v->dir > 0 && pos < safe_fp) {
+            size_t n = (size_t)((safe_fp - pos + step - 1) / step);
+            n = n < frames - i ? n : frames - i;
+            for (size_t k = 0; k < n; k++, i++) {
+                uint32_t idx = (uint32_t)(pos >> 16);
+                int32_t s = lerp(src[idx], src[idx + 1], pos);
+                out[i * 2] += s * gl;
+                out[i * 2 + 1] += s * gr;
+                pos += step;
+            }
+            continue;
+        }
+        if (step > 0 && v->dir < 0 && pos >= start_fp && pos < safe_fp) {
+            size_t n = (size_t)((pos - start_fp) / step) + 1;
+            n = n < frames - i ? n : frames - i;
+            for (size_t k = 0; k < n; k++, i++) {
+                uint32_t idx = (uint32_t)(pos >> 16);
+                int32_t s = lerp(src[idx], src[idx + 1], pos);
+                out[i * 2] += s * gl;
+                out[i * 2 + 1] += s * gr;
+                pos -= step;
+            }
+            continue;
+        }
+
+        // Wrap or reflect at the loop edges
+        if (v->dir > 0 && pos >= end_fp) {
+            if (mode == 0) {
+                v->active = false;
+                break;
+            }
+            int64_t over = (pos - end_fp) % (end_fp - start_fp);
+            if (mode == 1) {
+                pos = start_fp + over;
+            } else {
+                pos = end_fp - 1 - over;
+                v->dir = -1;
+            }
+            continue;
+        }
+        if (v->dir < 0 && pos < start_fp) {
+            pos = start_fp + (start_fp - pos) % (end_fp - start_fp);
+            v->dir = 1;
+            continue;
+        }
+
+        // Single frame next to the loop end
+        uint32_t idx = (uint32_t)(pos >> 16);
+        int32_t s0 = src[idx], s1;
+        if (idx + 1 < le) {
+            s1 = src[idx + 1];
+        } else if (mode == 1) {
+            s1 = src[ls];
+        } else {
+            s1 = s0;
+        }
+        int32_t s = lerp(s0, s1, pos);
+        out[i * 2] += s * gl;
+        out[i * 2 + 1] += s * gr;
+        pos += v->dir > 0 ? step : -step;
+        i++;
+    }
+    v->pos = pos;
+}
+
+void XMPlayer::mix_voice(xm_voice_t *v, int32_t *out, size_t frames) {
+    if (v->smp->play && v->smp->type.sample_bit) {
+        mix_samples(v, pcm_source<int16_t, 0>{(const int16_t *)v->smp->play}, out, frames);
+    } else if (v->smp->play) {
+        mix_samples(v, pcm_source<int8_t, 8>{(const int8_t *)v->smp->play}, out, frames);
+    } else if (v->smp->type.sample_bit) {
+        mix_samples(v, pcm_source<int16_t, 0>{v->smp->data.data()}, out, frames);
+    } else if (xm_sample_is_packed(v->smp)) {
+        mix_samples(v, adpcm_source{v}, out, frames);
+    } else {
+        mix_samples(v, pcm_source<int8_t, 8>{v->smp->data8.data()}, out, frames);
+    }
+}
+
+size_t XMPlayer::render(int16_t *out, size_t frames) {
+    if (header->songLength == 0) {
+        memset(out, 0, frames * 2 * sizeof(int16_t));
+        return frames;
+    }
+    size_t done = 0;
+    while (done < frames) {
+        if (tick_left == 0) {
+            next_tick();
+            // 2.5 * rate / bpm frames per tick, the fraction is carried to the next one
+            uint32_t len_fp = (uint32_t)(((uint64_t)rate * 5 << 16) / (bpm * 2));
+            tick_frac += len_fp;
+            tick_left = tick_frac >> 16;
+            tick_frac &= 0xFFFF;
+            continue;
+        }
+        size_t n = frames - done;
+        n = n < tick_left ? n : tick_left;
+        n = n < XM_PLAYER_MIX_CHUNK ? n : XM_PLAYER_MIX_CHUNK;
+
+        memset(mix_buf, 0, n * 2 * sizeof(int32_t));
+        for (int ch = 0; ch < num_channels; ch++) {
+            xm_voice_t *v = &voice[ch];
+            if (v->active && (v->gain_l | v->gain_r)) {
+                mix_voice(v, mix_buf, n);
+                voice_frames += n;
+            }
+        }
+        int16_t *dst = out + done * 2;
+        for (size_t i = 0; i < n * 2; i++) {
+            dst[i] = (int16_t)clamp((int32_t)(((int64_t)(mix_buf[i] >> 10) * amp) >> 8), -32768, 32767);
+        }
+        done += n;
+        tick_left -= n;
+    }
+    return frames;
+}
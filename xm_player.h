@@ -0,0 +1,139 @@
+#ifndef XM_PLAYER_H
+#define XM_PLAYER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xm_file.h"
+#include "xm_timeline.h"
+
+#define XM_PLAYER_MAX_CHANNELS 32
+#define XM_PLAYER_MIX_CHUNK 256 // frames mixed per pass
+
+typedef struct {
+    // Sample playback, position is 32.16 fixed point
+    const xm_instrument_t *inst = NULL;
+    const xm_sample_t *smp = NULL;
+    int64_t pos = 0;
+    uint32_t step = 0;      // 16.16 increment per output frame
+    int8_t dir = 1;         // -1 while a ping-pong loop plays backwards
+    bool active = false;
+
+    // Pitch, periods are in FT2 units (linear: 7680 - note * 64)
+    int32_t note64 = 0;     // (note + relNoteNum) * 64 + finetune / 2
+    int32_t period = 0;
+    int32_t target_period = 0;
+    int32_t period_ofs = 0; // vibrato / arpeggio, this tick only
+
+    // Volume 0..64, panning 0..255
+    int16_t volume = 0;
+    int16_t panning = 128;
+    int16_t volume_ofs = 0; // tremolo, this tick only
+
+    // Envelopes
+    bool key_on = false;
+    env_cursor_t vol_env;
+    env_cursor_t pan_env;
+    uint32_t fadeout = 65536;
+
+    // Current row
+    uint8_t note = 0;
+    uint8_t inst_num = 0;
+    uint8_t vol_cmd = 0;
+    uint8_t fx_cmd = 0;
+    uint8_t fx_val = 0;
+
+    // Effect memory
+    uint8_t arp_val = 0;
+    uint8_t porta_up = 0;
+    uint8_t porta_down = 0;
+    uint8_t fine_porta_up = 0;
+    uint8_t fine_porta_down = 0;
+    uint8_t tone_porta = 0;
+    uint8_t vibrato_speed = 0;
+    uint8_t vibrato_depth = 0;
+    uint8_t vibrato_pos = 0;
+    uint8_t tremolo_speed = 0;
+    uint8_t tremolo_depth = 0;
+    uint8_t tremolo_pos = 0;
+    uint8_t vol_slide = 0;
+    uint8_t fine_vol_up = 0;
+    uint8_t fine_vol_down = 0;
+    uint8_t global_vol_slide = 0;
+    uint8_t sample_offset = 0;
+    uint8_t loop_row = 0;
+    uint8_t loop_count = 0;
+
+    // Mixer gains for this tick, Q10
+    int32_t gain_l = 0;
+    int32_t gain_r = 0;
+
+    // Decoded window of a packed (ADPCM) sample, one block plus the sample after it
+    const xm_sample_t *adpcm_smp = NULL;
+    uint32_t adpcm_start = 0;
+    int8_t adpcm_buf[XM_ADPCM_BLOCK + 1];
+} xm_voice_t;
+
+// Fixed-point replayer for a loaded XMFile. render() never allocates; all patterns in
+// the order table are unpacked by the constructor so lazy loading doesn't allocate either.
+// Identical patterns are unpacked once (XMFile::find_duplicate_patterns()). A const
+// XMFile (e.g. from XMCache) is only read, patterns still packed play as empty.
+class XMPlayer {
+private:
+    const XMFile *xm;
+    const xm_header_t *header;
+    uint32_t rate;
+
+    std::vector<uint16_t> pattern_map; // identical patterns play from the first copy's cells
+
+    xm_voice_t voice[XM_PLAYER_MAX_CHANNELS];
+    uint16_t num_channels = 0;
+
+    uint16_t order = 0;
+    uint16_t row = 0;
+    uint16_t speed = 6;
+    uint16_t bpm = 125;
+    uint16_t tick = 0;
+    uint16_t global_vol = 64;
+    uint16_t pattern_delay = 0;
+    bool jump = false;
+    uint16_t jump_order = 0;
+    uint16_t jump_row = 0;
+    bool looped = false;
+    int32_t amp = 256; // Q8 master gain
+
+    uint32_t tick_left = 0;   // frames left in the current tick
+    uint32_t tick_frac = 0;   // 16.16 remainder of frames per tick
+    uint64_t voice_frames = 0;
+
+    int32_t mix_buf[XM_PLAYER_MIX_CHUNK * 2];
+
+    xm_pattern_cview_t view_at(uint16_t ord);
+    int32_t period_for(int32_t note64);
+    uint32_t step_for(int32_t period);
+    void next_tick();
+    void process_row();
+    void trigger(xm_voice_t *v, uint8_t note, uint8_t inst_num, bool porta);
+    void key_off(xm_voice_t *v);
+    void row_effects(xm_voice_t *v);
+    void tick_effects(xm_voice_t *v);
+    void vol_slide(xm_voice_t *v, uint8_t val);
+    void update_voice(xm_voice_t *v);
+    void mix_voice(xm_voice_t *v, int32_t *out, size_t frames);
+
+public:
+    XMPlayer(XMFile *xm, uint32_t sample_rate);
+    XMPlayer(const XMFile *xm, uint32_t sample_rate);
+
+    void reset(uint16_t start_order = 0); // song and voice state only, patterns stay unpacked
+    void seek(const xm_timeline_row_t *at); // song state from the timeline, voices start silent
+    size_t render(int16_t *out, size_t frames); // interleaved stereo
+    void set_amp(int32_t q8);
+
+    uint16_t get_order();
+    uint16_t get_row();
+    bool has_looped();          // the song wrapped to the restart position
+    uint64_t get_voice_frames(); // voice-samples mixed since reset()
+};
+
+#endif
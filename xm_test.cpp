@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "xm_file.h"
+#include "xm_timeline.h"
+#include "xm_player.h"
+#include "xm_cache.h"
+
+// Regression checks run by ctest: exits non-zero if any check fails
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            failures++;                                             \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+        }                                                           \
+    } while (0)
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Full-range noise makes the encoders clamp, a slow ramp takes the vector fast path
+static void fill_pcm(int16_t *pcm, size_t n, bool smooth) {
+    int16_t v = 0;
+    for (size_t i = 0; i < n; i++) {
+        v = smooth ? (int16_t)(v + (int)(rng() % 64) - 32) : (int16_t)rng();
+        pcm[i] = v;
+    }
+}
+
+typedef struct {
+    std::vector<int8_t> enc8;
+    std::vector<int16_t> enc16;
+    std::vector<int8_t> dec8;
+    std::vector<int16_t> dec8to16;
+    std::vector<int16_t> dec16;
+    std::vector<int16_t> dec16_le;
+    size_t err8 = 0;
+    size_t err16 = 0;
+} dpcm_out_t;
+
+// One pass through every public DPCM entry point with the selected kernels. The 16-bit
+// little-endian decoder reads from an odd address.
+static void run_dpcm(const std::vector<int8_t> &pcm8, const std::vector<int16_t> &pcm16, dpcm_out_t &out) {
+    size_t n = pcm8.size();
+    out.enc8.assign(n + 1, 0);
+    out.enc16.assign(n + 1, 0);
+    out.dec8.assign(n + 1, 0);
+    out.dec8to16.assign(n + 1, 0);
+    out.dec16.assign(n + 1, 0);
+    out.dec16_le.assign(n + 1, 0);
+    out.err8 = encode_dpcm_8bit(pcm8.data(), out.enc8.data(), n);
+    out.err16 = encode_dpcm_16bit(pcm16.data(), out.enc16.data(), n);
+    // Decode the raw PCM as deltas too, so the carries wrap
+    decode_dpcm_8bit(pcm8.data(), out.dec8.data(), n);
+    decode_dpcm_8bit_to_16bit(pcm8.data(), out.dec8to16.data(), n);
+    decode_dpcm_16bit(pcm16.data(), out.dec16.data(), n);
+    std::vector<uint8_t> le(n * 2 + 1);
+    for (size_t i = 0; i < n; i++) {
+        le[1 + i * 2] = (uint8_t)pcm16[i];
+        le[2 + i * 2] = (uint8_t)(pcm16[i] >> 8);
+    }
+    decode_dpcm_16bit_le(le.data() + 1, out.dec16_le.data(), n);
+}
+
+static void test_dpcm_kernels() {
+    static const char *const simd[] = {"sse2", "avx2", "neon"};
+    std::vector<size_t> lengths;
+    for (size_t n = 0; n <= 70; n++) {
+        lengths.push_back(n);
+    }
+    lengths.push_back(255);
+    lengths.push_back(1000);
+    lengths.push_back(4097);
+
+    int tested = 0;
+    for (size_t k = 0; k < sizeof(simd) / sizeof(simd[0]); k++) {
+        if (!dpcm_set_kernels(simd[k])) {
+            continue;
+        }
+        tested++;
+        for (size_t l = 0; l < lengths.size(); l++) {
+            for (int smooth = 0; smooth < 2; smooth++) {
+                size_t n = lengths[l];
+                std::vector<int16_t> pcm16(n);
+                fill_pcm(pcm16.data(), n, smooth);
+                std::vector<int8_t> pcm8(n);
+                for (size_t i = 0; i < n; i++) {
+                    pcm8[i] = (int8_t)(pcm16[i] >> 8);
+                }
+
+                dpcm_out_t ref, out;
+                dpcm_set_kernels("scalar");
+                run_dpcm(pcm8, pcm16, ref);
+                dpcm_set_kernels(simd[k]);
+                run_dpcm(pcm8, pcm16, out);
+
+                const char *kind = smooth ? "smooth" : "noise";
+                CHECK(out.err8 == ref.err8, "%s encode8 n=%zu %s: %zu errors, scalar %zu", simd[k], n, kind, out.err8, ref.err8);
+                CHECK(out.err16 == ref.err16, "%s encode16 n=%zu %s: %zu errors, scalar %zu", simd[k], n, kind, out.err16, ref.err16);
+                CHECK(out.enc8 == ref.enc8, "%s encode8 n=%zu %s", simd[k], n, kind);
+                CHECK(out.enc16 == ref.enc16, "%s encode16 n=%zu %s", simd[k], n, kind);
+                CHECK(out.dec8 == ref.dec8, "%s decode8 n=%zu %s", simd[k], n, kind);
+                CHECK(out.dec8to16 == ref.dec8to16, "%s decode8to16 n=%zu %s", simd[k], n, kind);
+                CHECK(out.dec16 == ref.dec16, "%s decode16 n=%zu %s", simd[k], n, kind);
+                CHECK(out.dec16_le == ref.dec16_le, "%s decode16_le n=%zu %s", simd[k], n, kind);
+            }
+        }
+    }
+    dpcm_set_simd(true);
+    printf("dpcm: %d SIMD kernel set(s) checked against scalar\n", tested);
+}
+
+static std::vector<xm_unit_t> random_cells(size_t n) {
+    std::vector<xm_unit_t> cells(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t r = rng();
+        // Mostly empty or sparse cells, some full ones for the 5-byte form
+        cells[i].note = (r & 3) ? 0 : 1 + rng() % 96;
+        cells[i].inst = (r & 12) ? 0 : 1 + rng() % 128;
+        cells[i].vol = (r & 48) ? 0 : 0x10 + rng() % 0x40;
+        cells[i].fx_cmd = (r & 64) ? 0 : rng() % 36;
+        cells[i].fx_val = (r & 128) ? 0 : rng() % 256;
+    }
+    return cells;
+}
+
+// Checked (readable = size) and unchecked (readable = worst case) decoding must agree
+static int unpack_both(const std::vector<uint8_t> &packed, int rows, int channels, std::vector<xm_unit_t> &cells) {
+    int checked = unpack_xm_pattern(packed.data(), packed.size(), cells, rows, channels);
+    std::vector<uint8_t> padded(packed);
+    padded.resize(packed.size() + (size_t)rows * channels * 6, 0);
+    std::vector<xm_unit_t> cells_fast;
+    int fast = unpack_xm_pattern(padded.data(), packed.size(), cells_fast, rows, channels, padded.size());
+    CHECK(checked == fast, "checked %d, unchecked %d, %zu bytes", checked, fast, packed.size());
+    return checked;
+}
+
+static void test_pattern_codec() {
+    const int rows = 64, channels = 8;
+    std::vector<xm_unit_t> cells = random_cells(rows * channels);
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+
+    std::vector<xm_unit_t> out;
+    CHECK(unpack_both(packed, rows, channels, out) == 0, "valid pattern rejected");
+    CHECK(out.size() == cells.size() && memcmp(out.data(), cells.data(), cells.size() * sizeof(xm_unit_t)) == 0,
+          "round trip differs");
+
+    // Every truncation must fail, however few cells the missing bytes cover
+    for (size_t len = 1; len < packed.size(); len++) {
+        std::vector<uint8_t> cut(packed.begin(), packed.begin() + len);
+        CHECK(unpack_both(cut, rows, channels, out) == FILE_READ_ERROR, "truncated to %zu of %zu bytes accepted", len, packed.size());
+    }
+
+    std::vector<uint8_t> overlong(packed);
+    overlong.push_back(0x80);
+    CHECK(unpack_both(overlong, rows, channels, out) == FILE_READ_ERROR, "trailing byte accepted");
+
+    // The last cell's mask announces all five fields, only two follow
+    std::vector<xm_unit_t> one(1);
+    std::vector<uint8_t> short_cell = {0x9F, 0x31, 0x01};
+    CHECK(unpack_both(short_cell, 1, 1, one) == FILE_READ_ERROR, "mask past the end accepted");
+    // An uncompressed cell (mask < 0x80) needs four more bytes
+    std::vector<uint8_t> short_raw = {0x31, 0x01, 0x40};
+    CHECK(unpack_both(short_raw, 1, 1, one) == FILE_READ_ERROR, "short uncompressed cell accepted");
+
+    // No data is an empty pattern
+    std::vector<uint8_t> none;
+    CHECK(unpack_both(none, rows, channels, out) == 0, "empty pattern rejected");
+    printf("pattern codec: %zu truncations checked\n", packed.size() - 1);
+}
+
+static void put16(std::vector<uint8_t> &buf, uint16_t v) {
+    buf.push_back(v & 0xFF);
+    buf.push_back(v >> 8);
+}
+
+static void put32(std::vector<uint8_t> &buf, uint32_t v) {
+    put16(buf, v & 0xFFFF);
+    put16(buf, v >> 16);
+}
+
+// Module with one pattern per entry of packed[], no instruments, played in order
+static std::vector<uint8_t> make_module(const std::vector<std::vector<uint8_t> > &packed, const std::vector<uint16_t> &rows, int channels) {
+    // ID, name, 0x1A and tracker name: 17 + 20 + 1 + 20 bytes, the names left empty
+    std::vector<uint8_t> buf(58, 0);
+    memcpy(buf.data(), "Extended Module: ", 17);
+    buf[37] = 0x1A;
+    put16(buf, 0x0104);
+    put32(buf, 20 + 256);
+    put16(buf, packed.size()); // song length
+    put16(buf, 0);             // restart
+    put16(buf, channels);
+    put16(buf, packed.size()); // patterns
+    put16(buf, 0);             // instruments
+    put16(buf, 1);             // linear
+    put16(buf, 6);
+    put16(buf, 125);
+    for (int i = 0; i < 256; i++) {
+        buf.push_back(i < (int)packed.size() ? i : 0);
+    }
+    for (size_t i = 0; i < packed.size(); i++) {
+        put32(buf, 9);
+        buf.push_back(0);
+        put16(buf, rows[i]);
+        put16(buf, packed[i].size());
+        buf.insert(buf.end(), packed[i].begin(), packed[i].end());
+    }
+    return buf;
+}
+
+static void test_corrupt_module() {
+    const int rows = 16, channels = 4;
+    std::vector<xm_unit_t> cells = random_cells(rows * channels);
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    std::vector<uint8_t> good = make_module({packed, packed}, {rows, rows}, channels);
+    CHECK(xm.load_from_memory(good.data(), good.size()) == 0, "valid module rejected");
+
+    // Declared one byte short: the next pattern header follows, so the unchecked
+    // decoder may read on, but it has to end exactly at packedPatternSize
+    std::vector<uint8_t> cut(packed.begin(), packed.end() - 1);
+    std::vector<uint8_t> bad = make_module({packed, cut}, {rows, rows}, channels);
+    CHECK(xm.load_from_memory(bad.data(), bad.size()) == FILE_READ_ERROR, "truncated pattern loaded");
+    bad = make_module({cut, packed}, {rows, rows}, channels);
+    CHECK(xm.load_from_memory(bad.data(), bad.size()) == FILE_READ_ERROR, "truncated pattern loaded");
+
+    std::vector<uint8_t> longer(packed);
+    longer.push_back(0x80);
+    bad = make_module({longer}, {rows}, channels);
+    CHECK(xm.load_from_memory(bad.data(), bad.size()) == FILE_READ_ERROR, "overlong pattern loaded");
+
+    // Lazy patterns fail when unpacked instead
+    xm.set_load_flags(XM_LOAD_LAZY_PATTERNS);
+    bad = make_module({packed, cut}, {rows, rows}, channels);
+    CHECK(xm.load_from_memory(bad.data(), bad.size()) == 0, "lazy load failed");
+    CHECK(xm.peek_pattern_view(0).cells != NULL, "lazy pattern 0 not unpacked");
+    CHECK(xm.peek_pattern_view(1).cells == NULL, "lazy truncated pattern unpacked");
+    CHECK(xm.get_pattern(1) == NULL, "lazy truncated pattern returned");
+    printf("corrupt modules: checked\n");
+}
+
+// Appends an instrument with one sample: length in bytes as stored, type 0x10 = 16-bit,
+// data_bytes of 1s as DPCM data. Goes after the patterns, so add patterns first.
+static void add_instrument(std::vector<uint8_t> &mod, uint32_t length, uint8_t type, size_t data_bytes) {
+    mod[72]++; // numInstruments
+    put32(mod, 263);
+    mod.resize(mod.size() + 23, 0); // name, type
+    put16(mod, 1);
+    put32(mod, 40); // sample header size
+    mod.resize(mod.size() + 230, 0);
+    put32(mod, length);
+    put32(mod, 0);
+    put32(mod, 0);
+    mod.push_back(64);
+    mod.push_back(0);
+    mod.push_back(type);
+    mod.resize(mod.size() + 25, 0); // panning, note, reserved, name
+    mod.resize(mod.size() + data_bytes, 1);
+}
+
+// Sizes in the file that point past its end must fail or be cut, not allocate what they claim
+static void test_oversized_lengths() {
+    std::vector<uint8_t> empty;
+    std::vector<uint8_t> mod = make_module({empty}, {64}, 4);
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+
+    std::vector<uint8_t> bad(mod);
+    bad[60] = 0xF0; // header size 0xFFFFFFF0
+    bad[61] = bad[62] = bad[63] = 0xFF;
+    CHECK(xm.load_from_memory(bad.data(), bad.size()) == FILE_READ_ERROR, "header size past the end accepted");
+
+    // An 8-bit and a 16-bit sample, each claiming ~2 GB but 10 bytes long
+    for (int wide = 0; wide < 2; wide++) {
+        std::vector<uint8_t> inst(mod);
+        add_instrument(inst, 0x7FFFFFF0, wide ? 0x10 : 0, 10);
+        CHECK(xm.load_from_memory(inst.data(), inst.size()) == 0, "truncated sample rejected");
+        const xm_instrument_t *ins = xm.get_instrument(0);
+        uint32_t length = ins && ins->sample.size() == 1 ? ins->sample[0].length : 0;
+        CHECK(length == (wide ? 5u : 10u), "%s sample length %u after truncation", wide ? "16-bit" : "8-bit", length);
+        CHECK(xm.get_stats().sample_bytes < (1 << 20), "%llu sample bytes", (unsigned long long)xm.get_stats().sample_bytes);
+    }
+    printf("oversized lengths: checked\n");
+}
+
+// XM allows up to 256 rows but the header field is 16-bit. With 257 rows in order 0 the
+// last row must not share its visited bit with order 1, row 0.
+static void test_timeline_long_pattern() {
+    std::vector<uint8_t> empty;
+    std::vector<uint8_t> mod = make_module({empty, empty}, {257, 1}, 4);
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    CHECK(xm.load_from_memory(mod.data(), mod.size()) == 0, "257-row module rejected");
+
+    XMTimeline timeline;
+    CHECK(timeline.build(&xm, 44100) == 0, "timeline build failed");
+    CHECK(timeline.size() == 258, "%zu rows in the timeline, expected 258", timeline.size());
+    CHECK(timeline.find_row(0, 256) != NULL, "order 0 row 256 not played");
+    CHECK(timeline.find_row(1, 0) != NULL, "order 1 row 0 not played");
+    const xm_timeline_row_t *loop = timeline.get_loop_row();
+    CHECK(loop && loop->order == 0 && loop->row == 0, "song doesn't loop to order 0 row 0");
+    printf("timeline: 257-row pattern checked\n");
+}
+
+// Empty string if the file couldn't be written
+static std::string write_temp(const std::vector<uint8_t> &data) {
+    const char *tmp_dir = getenv("TMPDIR");
+    std::string path = std::string(tmp_dir && tmp_dir[0] ? tmp_dir : "/tmp") + "/xm_test_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    CHECK(fd >= 0, "mkstemp failed");
+    if (fd < 0) {
+        return "";
+    }
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    CHECK(ok, "write failed");
+    close(fd);
+    if (!ok) {
+        remove(path.c_str());
+        return "";
+    }
+    return path;
+}
+
+// A lazy pattern found corrupt while writing a cache fails the save, no partial file is left
+static void test_cache_corrupt_lazy() {
+    const int rows = 16, channels = 4;
+    std::vector<xm_unit_t> cells = random_cells(rows * channels);
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+    std::vector<uint8_t> cut(packed.begin(), packed.end() - 1);
+    std::vector<uint8_t> mod = make_module({packed, cut}, {rows, rows}, channels);
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    xm.set_load_flags(XM_LOAD_LAZY_PATTERNS);
+    CHECK(xm.load_from_memory(mod.data(), mod.size()) == 0, "lazy load failed");
+    std::string path = write_temp(std::vector<uint8_t>());
+    if (path.empty()) {
+        return;
+    }
+    CHECK(xm.save_cache(path.c_str()) == FILE_READ_ERROR, "cache saved with a corrupt pattern");
+    CHECK(access(path.c_str(), F_OK) != 0, "partial cache file left behind");
+    remove(path.c_str());
+    printf("cache of a corrupt lazy module: checked\n");
+}
+
+// An edited XM_LOAD_KEEP_SOURCE module saved over its own (mapped) source file
+static void test_save_over_source() {
+    const int rows = 16, channels = 4;
+    std::vector<xm_unit_t> cells = random_cells(rows * channels);
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+    std::vector<uint8_t> mod = make_module({packed, packed}, {rows, rows}, channels);
+
+    std::string path = write_temp(mod);
+    if (path.empty()) {
+        return;
+    }
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    xm.set_load_flags(XM_LOAD_KEEP_SOURCE);
+    CHECK(xm.open_xm_mmap(path.c_str()) == 0 && xm.read_all() == 0, "load failed");
+    xm.get_pattern(1)->unpk_pattern[0].note = 49;
+    std::vector<uint8_t> expect;
+    xm.save_to_memory(expect);
+    CHECK(xm.save_as(path.c_str()) == 0, "save over the source failed");
+    CHECK(xm.save_as(path.c_str()) == 0, "second save over the source failed");
+
+    XMFile back;
+    back.set_log(XM_LOG_NONE);
+    std::vector<uint8_t> got;
+    CHECK(back.open_xm(path.c_str()) == 0 && back.read_all() == 0 && back.save_to_memory(got) == 0, "reload failed");
+    CHECK(got == expect, "saved module differs");
+    remove(path.c_str());
+    printf("save over source: checked\n");
+}
+
+// One cached module read from several threads at once through the const interface
+static void test_cache_shared_readers() {
+    const int rows = 32, channels = 4;
+    std::vector<xm_unit_t> cells = random_cells(rows * channels);
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+    std::string path = write_temp(make_module({packed, packed, packed}, {rows, rows, rows}, channels));
+    if (path.empty()) {
+        return;
+    }
+
+    XMCache cache(64 << 20, XM_LOAD_LAZY_PATTERNS); // the cache loads fully anyway
+    std::shared_ptr<const XMFile> xm = cache.get(path.c_str());
+    CHECK(xm != NULL, "cache load failed");
+    if (xm) {
+        CHECK(xm->peek_pattern_view(2).cells != NULL, "cached pattern still packed");
+        XMTimeline reference;
+        reference.build(xm.get(), 44100);
+        const int threads = 4;
+        uint16_t dups[threads] = {0};
+        size_t timeline_rows[threads] = {0};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                std::vector<uint16_t> map;
+                dups[t] = xm->find_duplicate_patterns(map);
+                XMTimeline timeline;
+                timeline.build(xm.get(), 44100);
+                timeline_rows[t] = timeline.size();
+                XMPlayer player(xm.get(), 44100);
+                std::vector<int16_t> pcm(4096 * 2);
+                player.render(pcm.data(), 4096);
+            });
+        }
+        for (int t = 0; t < threads; t++) {
+            workers[t].join();
+            CHECK(dups[t] == 2, "thread %d found %d duplicate patterns, expected 2", t, dups[t]);
+            CHECK(timeline_rows[t] == reference.size(), "thread %d timeline has %zu rows, expected %zu", t, timeline_rows[t],
+                  reference.size());
+        }
+    }
+    remove(path.c_str());
+    printf("cache: shared const readers checked\n");
+}
+
+// Frames the player renders before it moves off row 0
+static uint64_t player_row0_frames(const std::vector<uint8_t> &mod) {
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    CHECK(xm.load_from_memory(mod.data(), mod.size()) == 0, "load failed");
+    XMPlayer player(&xm, 44100);
+    int16_t pcm[2];
+    uint64_t frames = 0;
+    while (player.get_row() == 0 && frames < 441000) {
+        player.render(pcm, 1);
+        frames++;
+    }
+    return frames;
+}
+
+// EE0 then EE3 on one row: the first pattern delay wins in both the timeline and the player
+static void test_pattern_delay_precedence() {
+    const int rows = 2, channels = 2;
+    std::vector<xm_unit_t> cells(rows * channels);
+    std::vector<uint8_t> plain;
+    pack_xm_pattern(cells, plain, rows, channels);
+    cells[0].fx_cmd = 0xE;
+    cells[0].fx_val = 0xE0;
+    cells[1].fx_cmd = 0xE;
+    cells[1].fx_val = 0xE3;
+    std::vector<uint8_t> packed;
+    pack_xm_pattern(cells, packed, rows, channels);
+    std::vector<uint8_t> mod = make_module({packed}, {rows}, channels);
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    CHECK(xm.load_from_memory(mod.data(), mod.size()) == 0, "load failed");
+    XMTimeline timeline;
+    timeline.build(&xm, 44100);
+    int ticks = timeline.size() == 2 ? timeline.at(0)->ticks : 0;
+    CHECK(ticks == 6, "timeline: row 0 lasts %d ticks, expected 6", ticks);
+
+    uint64_t delayed = player_row0_frames(mod), undelayed = player_row0_frames(make_module({plain}, {rows}, channels));
+    CHECK(delayed == undelayed, "player: row 0 lasts %llu frames, %llu without the EEx", (unsigned long long)delayed,
+          (unsigned long long)undelayed);
+    printf("pattern delay precedence: checked\n");
+}
+
+// Merging renumbers only the patterns that use a dropped instrument, the rest stay clean
+static void test_merge_keeps_patterns_clean() {
+    const int rows = 4, channels = 2;
+    std::vector<xm_unit_t> uses1(rows * channels), uses2(rows * channels);
+    uses1[0].note = uses2[0].note = 49;
+    uses1[0].inst = 1;
+    uses2[0].inst = 2;
+    std::vector<uint8_t> p1, p2;
+    pack_xm_pattern(uses1, p1, rows, channels);
+    pack_xm_pattern(uses2, p2, rows, channels);
+    std::vector<uint8_t> mod = make_module({p1, p2}, {rows, rows}, channels);
+    add_instrument(mod, 16, 0, 16);
+    add_instrument(mod, 16, 0, 16); // identical to the first
+
+    XMFile xm;
+    xm.set_log(XM_LOG_NONE);
+    xm.set_load_flags(XM_LOAD_KEEP_SOURCE);
+    CHECK(xm.load_from_memory(mod.data(), mod.size()) == 0, "load failed");
+    CHECK(xm.merge_duplicate_instruments() == 1, "duplicate instrument not merged");
+    CHECK(!xm.is_pattern_dirty(0), "pattern 0 dirty though its numbers didn't change");
+    CHECK(xm.is_pattern_dirty(1), "pattern 1 not renumbered");
+    CHECK(xm.peek_pattern_view(1).cells && xm.peek_pattern_view(1).cells[0].inst == 1, "pattern 1 still uses instrument 2");
+    printf("merge duplicates: clean patterns checked\n");
+}
+
+int main() {
+    test_dpcm_kernels();
+    test_pattern_codec();
+    test_corrupt_module();
+    test_oversized_lengths();
+    test_timeline_long_pattern();
+    test_merge_keeps_patterns_clean();
+    test_pattern_delay_precedence();
+    test_cache_corrupt_lazy();
+    test_save_over_source();
+    test_cache_shared_readers();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
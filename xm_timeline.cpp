@@ -0,0 +1,233 @@
+#include "xm_timeline.h"
+
+#include <algorithm>
+
+#include "xm_player.h"
+
+// Pathological E6x nesting can keep a song inside pattern loops forever
+static const size_t max_rows = 1 << 20;
+
+static uint16_t clamp_vol(int32_t v) {
+    return v < 0 ? 0 : (v > 64 ? 64 : v);
+}
+
+// Lazy patterns are unpacked first, the walk itself only reads
+int XMTimeline::build(XMFile *xm, uint32_t sample_rate) {
+    const xm_header_t *header = xm->get_header();
+    for (uint16_t i = 0; i < header->songLength; i++) {
+        xm->peek_pattern_view(header->orderTable[i]);
+    }
+    return build((const XMFile *)xm, sample_rate);
+}
+
+int XMTimeline::build(const XMFile *xm, uint32_t sample_rate) {
+    const xm_header_t *header = xm->get_header();
+    rate = sample_rate ? sample_rate : 44100;
+    rows.clear();
+    first_visit.clear();
+    length = 0;
+    loop_row = -1;
+    if (header->songLength == 0) {
+        return 0;
+    }
+    // One bit per row the walk can stand on; an order without cells still has row 0
+    order_bit.resize(header->songLength + 1);
+    order_bit[0] = 0;
+    for (uint16_t i = 0; i < header->songLength; i++) {
+        uint16_t num_rows = xm->peek_pattern_view(header->orderTable[i]).rows;
+        order_bit[i + 1] = order_bit[i] + (num_rows ? num_rows : 1);
+    }
+    visited.assign((order_bit[header->songLength] + 7) / 8, 0);
+
+    int num_channels = header->numChannels < XM_PLAYER_MAX_CHANNELS ? header->numChannels : XM_PLAYER_MAX_CHANNELS;
+    uint8_t loop_start[XM_PLAYER_MAX_CHANNELS] = {0};
+    uint8_t loop_count[XM_PLAYER_MAX_CHANNELS] = {0};
+    uint8_t vol_slide[XM_PLAYER_MAX_CHANNELS] = {0};
+    uint16_t order = 0, row = 0;
+    uint16_t speed = header->defaultTempo ? header->defaultTempo : 6;
+    uint16_t bpm = header->defaultBPM >= 32 ? header->defaultBPM : 125;
+    uint16_t global_vol = 64;
+    uint32_t tick_frac = 0;
+    uint64_t frame = 0;
+
+    while (rows.size() < max_rows) {
+        bool in_loop = false;
+        for (int ch = 0; ch < num_channels; ch++) {
+            in_loop |= loop_count[ch] != 0;
+        }
+        size_t bit = order_bit[order] + row;
+        if (!in_loop) {
+            if (visited[bit >> 3] & (1 << (bit & 7))) {
+                break; // played before: the song loops here
+            }
+            visited[bit >> 3] |= 1 << (bit & 7);
+        }
+
+        xm_timeline_row_t r;
+        r.frame = frame;
+        r.tick_frac = tick_frac;
+        r.order = order;
+        r.row = row;
+        r.speed = speed;
+        r.bpm = bpm;
+        r.global_vol = global_vol;
+
+        // Row effects, the same rules as XMPlayer::row_effects()
+        xm_pattern_cview_t view = xm->peek_pattern_view(header->orderTable[order]);
+        bool jump = false;
+        uint16_t jump_order = 0, jump_row = 0, plays = 0; // plays: EEx count + 1, 0 until set
+        const xm_unit_t *cells = view.cells && row < view.rows ? view.row(row) : NULL;
+        for (int ch = 0; cells && ch < num_channels; ch++) {
+            uint8_t val = cells[ch].fx_val, hi = val >> 4, lo = val & 0x0F;
+            switch (cells[ch].fx_cmd) {
+            case 0xB:
+                if (!jump) {
+                    jump_row = 0;
+                }
+                jump = true;
+                jump_order = val;
+                break;
+            case 0xD:
+                if (!jump) {
+                    jump_order = order + 1;
+                }
+                jump = true;
+                jump_row = hi * 10 + lo;
+                break;
+            case 0xE:
+                if (hi == 0x6 && lo == 0) {
+                    loop_start[ch] = row;
+                } else if (hi == 0x6 && (loop_count[ch] == 0 || --loop_count[ch])) {
+                    if (loop_count[ch] == 0) {
+                        loop_count[ch] = lo;
+                    }
+                    jump = true;
+                    jump_order = order;
+                    jump_row = loop_start[ch];
+                } else if (hi == 0xE && plays == 0) { // the first EEx wins, EE0 included, as in the player
+                    plays = lo + 1;
+                }
+                break;
+            case 0xF:
+                if (val && val < 32) {
+                    speed = val;
+                } else if (val >= 32) {
+                    bpm = val;
+                }
+                break;
+            case 0x10:
+                global_vol = val > 64 ? 64 : val;
+                break;
+            case 0x11:
+                if (val) vol_slide[ch] = val;
+                break;
+            }
+        }
+
+        // Row length with the speed and BPM it set, ticks sized like XMPlayer::render()
+        r.ticks = speed * (plays ? plays : 1);
+        uint32_t len_fp = (uint32_t)(((uint64_t)rate * 5 << 16) / (bpm * 2));
+        for (uint16_t t = 0; t < r.ticks; t++) {
+            tick_frac += len_fp;
+            frame += tick_frac >> 16;
+            tick_frac &= 0xFFFF;
+        }
+        // Hxy slides on every tick but the row's first
+        for (uint16_t t = 1; cells && t < r.ticks; t++) {
+            for (int ch = 0; ch < num_channels; ch++) {
+                if (cells[ch].fx_cmd == 0x11 && (vol_slide[ch] & 0xF0)) {
+                    global_vol = clamp_vol(global_vol + (vol_slide[ch] >> 4));
+                } else if (cells[ch].fx_cmd == 0x11) {
+                    global_vol = clamp_vol(global_vol - (vol_slide[ch] & 0x0F));
+                }
+            }
+        }
+        rows.push_back(r);
+
+        if (jump) {
+            order = jump_order;
+            row = jump_row;
+        } else if (++row >= view.rows) {
+            row = 0;
+            order++;
+        }
+        if (order >= header->songLength) {
+            order = header->resetVector < header->songLength ? header->resetVector : 0;
+        }
+        if (row >= xm->peek_pattern_view(header->orderTable[order]).rows) {
+            row = 0;
+        }
+    }
+    length = frame;
+
+    for (size_t i = 0; i < rows.size(); i++) {
+        uint64_t key = (uint64_t)rows[i].order << 16 | rows[i].row;
+        first_visit.push_back(key << 32 | i);
+    }
+    // Equal rows sort by index, the first play comes first
+    std::sort(first_visit.begin(), first_visit.end());
+    size_t n = 0;
+    for (size_t i = 0; i < first_visit.size(); i++) {
+        if (n == 0 || (first_visit[n - 1] >> 32) != (first_visit[i] >> 32)) {
+            first_visit[n++] = first_visit[i];
+        }
+    }
+    first_visit.resize(n);
+
+    if (rows.size() < max_rows) {
+        const xm_timeline_row_t *r = find_row(order, row);
+        loop_row = r ? r - rows.data() : -1;
+    }
+    return 0;
+}
+
+size_t XMTimeline::size() {
+    return rows.size();
+}
+
+const xm_timeline_row_t *XMTimeline::at(size_t i) {
+    return i < rows.size() ? &rows[i] : NULL;
+}
+
+uint64_t XMTimeline::get_length_frames() {
+    return length;
+}
+
+uint32_t XMTimeline::get_length_ms() {
+    return frame_to_ms(length);
+}
+
+const xm_timeline_row_t *XMTimeline::get_loop_row() {
+    return loop_row >= 0 ? &rows[loop_row] : NULL;
+}
+
+const xm_timeline_row_t *XMTimeline::find_frame(uint64_t frame) {
+    if (frame >= length) {
+        return NULL;
+    }
+    // Last row starting at or before frame
+    auto it = std::upper_bound(rows.begin(), rows.end(), frame,
+                               [](uint64_t f, const xm_timeline_row_t &r) { return f < r.frame; });
+    return &*(it - 1);
+}
+
+const xm_timeline_row_t *XMTimeline::find_ms(uint32_t ms) {
+    return find_frame(ms_to_frame(ms));
+}
+
+const xm_timeline_row_t *XMTimeline::find_row(uint16_t order, uint16_t row) {
+    uint64_t key = (uint64_t)order << 16 | row;
+    auto it = std::lower_bound(first_visit.begin(), first_visit.end(), key << 32);
+    if (it == first_visit.end() || (*it >> 32) != key) {
+        return NULL;
+    }
+    return &rows[(uint32_t)*it];
+}
+
+uint32_t XMTimeline::frame_to_ms(uint64_t frame) {
+    return (uint32_t)(frame * 1000 / rate);
+}
+
+uint64_t XMTimeline::ms_to_frame(uint32_t ms) {
+    return (uint64_t)ms * rate / 1000;
+}
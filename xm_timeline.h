@@ -0,0 +1,54 @@
+#ifndef XM_TIMELINE_H
+#define XM_TIMELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "xm_file.h"
+
+// One played row, in play order. Speed, BPM and global volume are the values before the
+// row's own effects, so a player resumed here with them reproduces the song from this row.
+typedef struct {
+    uint64_t frame = 0;     // first output frame of the row at the timeline's rate
+    uint32_t tick_frac = 0; // 16.16 remainder of frames carried into the row's first tick
+    uint16_t order = 0;
+    uint16_t row = 0;
+    uint16_t speed = 6;
+    uint16_t bpm = 125;
+    uint16_t global_vol = 64;
+    uint16_t ticks = 0;     // length of the row, pattern delay included
+} xm_timeline_row_t;
+
+// Row/time index of a song, built by walking the order table with the player's rules for
+// Fxx, Bxx, Dxx, E6x, EEx and Gxx/Hxy, without mixing anything. The walk stops when a row
+// is played a second time outside a pattern loop, which is where the song loops.
+class XMTimeline {
+private:
+    uint32_t rate = 44100;
+    std::vector<xm_timeline_row_t> rows;
+    std::vector<uint64_t> first_visit; // (order << 16 | row) << 32 | rows[] index of its first play, sorted
+    std::vector<uint32_t> order_bit;   // first bit of each order in visited, songLength + 1 entries
+    std::vector<uint8_t> visited;      // every row of every order, one bit each
+    uint64_t length = 0;               // song length in frames
+    int64_t loop_row = -1;             // rows[] index the song loops back to, -1 if it ends
+
+public:
+    int build(XMFile *xm, uint32_t sample_rate);
+    int build(const XMFile *xm, uint32_t sample_rate); // patterns still packed count as empty
+
+    size_t size();
+    const xm_timeline_row_t *at(size_t i);
+    uint64_t get_length_frames();
+    uint32_t get_length_ms();
+    const xm_timeline_row_t *get_loop_row(); // NULL if the song doesn't loop
+
+    // O(log n) lookups, NULL when out of range or never played
+    const xm_timeline_row_t *find_frame(uint64_t frame);
+    const xm_timeline_row_t *find_ms(uint32_t ms);
+    const xm_timeline_row_t *find_row(uint16_t order, uint16_t row);
+    uint32_t frame_to_ms(uint64_t frame);
+    uint64_t ms_to_frame(uint32_t ms);
+};
+
+#endif